@@ -0,0 +1,242 @@
+/*
+ * arena.hpp
+ *
+ *
+ * Swiss Per-Request Arena
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <cassert>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "include/module.h"
+
+// size of a regular chunk, larger allocations get a chunk of their own
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// regular chunks a thread keeps around between requests
+#define ARENA_CACHE_CHUNKS 16
+#define ARENA_ALIGN 16
+
+
+typedef struct arena_chunk_st {
+  arena_chunk_st *next;
+  size_t          size;   // usable bytes after the header
+} arena_chunk_st;
+
+
+/*
+ * One arena per worker thread, handed to every request the thread
+ * runs. Allocation is a pointer bump in the module library, the core
+ * is only called through grow() when a chunk runs out. reset() rewinds
+ * to the first chunk, so a request that fit in one chunk costs nothing
+ * to free; extra chunks go back on the thread's free list and
+ * oversized blocks are freed outright.
+ */
+class Arena {
+
+public:
+  Arena() : used_(NULL), big_(NULL), free_(NULL), free_count_(0)
+  {
+    arena_.cur = NULL;
+    arena_.end = NULL;
+    arena_.grow = &grow;
+    arena_.core = this;
+  }
+
+  ~Arena()
+  {
+    reset();
+    release(used_);
+    release(free_);
+  }
+
+  // the calling thread's arena, created on first use
+  static Arena *local()
+  {
+    static pthread_key_t key = makeKey();
+    Arena *arena;
+
+    if ((arena = static_cast<Arena *>(pthread_getspecific(key))) == NULL) {
+      arena = new Arena();
+      pthread_setspecific(key, arena);
+    }
+
+    return (arena);
+  }
+
+  swiss_arena_st *get()
+  {
+    return (&arena_);
+  }
+
+  void reset()
+  {
+    arena_chunk_st *chunk;
+
+    release(big_);
+    big_ = NULL;
+
+    if (!used_) {
+      return;
+    }
+
+    while (used_->next) {
+      chunk = used_;
+      used_ = used_->next;
+      recycle(chunk);
+    }
+
+    // used_ is now the first chunk, oversized blocks are never on it
+    arena_.cur = (uint8_t *)(used_ + 1);
+    arena_.end = arena_.cur + used_->size;
+  }
+
+private:
+  static void *grow(swiss_arena_st *a, size_t size)
+  {
+    Arena *arena = static_cast<Arena *>(a->core);
+    arena_chunk_st *chunk;
+    uint8_t *ptr;
+
+    // neither the rounding nor the chunk header may wrap
+    if (size > SIZE_MAX - sizeof(arena_chunk_st) - (ARENA_ALIGN - 1)) {
+      return (NULL);
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+    if (size > ARENA_CHUNK_SIZE) {
+      // keep bumping the current chunk, the big block only lives until reset()
+      if ((chunk = (arena_chunk_st *)malloc(sizeof(arena_chunk_st) + size)) == NULL) {
+	return (NULL);
+      }
+      chunk->size = size;
+      chunk->next = arena->big_;
+      arena->big_ = chunk;
+      return (chunk + 1);
+    }
+
+    if ((chunk = arena->chunk(size)) == NULL) {
+      return (NULL);
+    }
+    chunk->next = arena->used_;
+    arena->used_ = chunk;
+
+    ptr = (uint8_t *)(chunk + 1);
+    a->cur = ptr + size;
+    a->end = ptr + chunk->size;
+
+    return (ptr);
+  }
+
+  arena_chunk_st *chunk(size_t size)
+  {
+    arena_chunk_st *chunk;
+
+    if ((size <= ARENA_CHUNK_SIZE) && (free_)) {
+      chunk = free_;
+      free_ = free_->next;
+      --free_count_;
+      return (chunk);
+    }
+
+    if (size < ARENA_CHUNK_SIZE) {
+      size = ARENA_CHUNK_SIZE;
+    }
+
+    if ((chunk = (arena_chunk_st *)malloc(sizeof(arena_chunk_st) + size)) != NULL) {
+      chunk->size = size;
+    }
+
+    return (chunk);
+  }
+
+  void recycle(arena_chunk_st *chunk)
+  {
+    if ((chunk->size != ARENA_CHUNK_SIZE) || (free_count_ >= ARENA_CACHE_CHUNKS)) {
+      free(chunk);
+      return;
+    }
+
+    chunk->next = free_;
+    free_ = chunk;
+    ++free_count_;
+  }
+
+  static void release(arena_chunk_st *chunk)
+  {
+    while (chunk) {
+      arena_chunk_st *next = chunk->next;
+
+      free(chunk);
+      chunk = next;
+    }
+  }
+
+  static pthread_key_t makeKey()
+  {
+    pthread_key_t key;
+
+    assert(pthread_key_create(&key, &destroy) == 0);
+    return (key);
+  }
+
+  static void destroy(void *arena)
+  {
+    delete static_cast<Arena *>(arena);
+  }
+
+  swiss_arena_st arena_;
+  arena_chunk_st *used_;
+  arena_chunk_st *big_;
+  arena_chunk_st *free_;
+  uint32_t free_count_;
+};
+
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * capture.hpp
+ *
+ *
+ * Swiss Traffic Capture
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "include/capture.h"
+#include "thread_pool/thread_pool.hpp"
+
+// highest fd a connection can be tracked under
+#define CAPTURE_MAX_FD 65536
+
+
+/*
+ * Records what a module reads from its connections into an append only
+ * file mapped MAP_SHARED. The file's blocks are allocated up to the byte
+ * limit before it is mapped, so a full disk fails the capture at start
+ * instead of faulting a writer, and each record reserves its space with
+ * an atomic add on the tail, so writers never lock or remap. Once the
+ * limit is reached further records are dropped. finish() truncates
+ * the file to what was written; it runs when the server stops, while
+ * module threads may still be reading, so appends are fenced off with
+ * a count of writers in flight.
+ *
+ * Connections are numbered at accept and the number travels with the
+ * request. Reads are matched to it by fd, which the module holds open
+ * while it reads. The module may close the fd inside work() and the
+ * acceptor can hand it to a new connection before the old one is
+ * finished, so closed() takes the number, not the fd, and only clears
+ * the fd's slot if it still belongs to that connection.
+ */
+class Capture {
+
+public:
+  Capture(const char *dir, const uint16_t port, const uint64_t limit) : 
+    base_(NULL), size_(limit), tail_(sizeof(swiss_capture_hdr_st)), next_conn_(0), dropped_(0), 
+    writers_(0), finished_(false)
+  {
+    swiss_capture_hdr_st *hdr;
+    struct timespec ts;
+    int fd;
+
+    snprintf(path_, sizeof(path_), "%s/swiss.%d.%u.cap", dir, getpid(), port);
+
+    if ((fd = ::open(path_, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+      throw "unable to create capture file";
+    }
+
+    if (posix_fallocate(fd, 0, size_) != 0) {
+      ::close(fd);
+      unlink(path_);
+      throw "unable to allocate capture file";
+    }
+
+    if ((base_ = (uint8_t *)mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      ::close(fd);
+      unlink(path_);
+      throw "unable to map capture file";
+    }
+    fd_ = fd;
+
+    conns_ = new uint32_t[CAPTURE_MAX_FD];
+    memset(conns_, 0, sizeof(uint32_t) * CAPTURE_MAX_FD);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    start_ = ThreadPool::now();
+
+    hdr = (swiss_capture_hdr_st *)base_;
+    hdr->magic = SWISS_CAPTURE_MAGIC;
+    hdr->start_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    hdr->port = port;
+    hdr->reserved = 0;
+  }
+
+  ~Capture()
+  {
+    finish();
+    munmap(base_, size_);
+    ::close(fd_);
+    delete [] conns_;
+  }
+
+  // stops recording, later records are dropped silently
+  void finish()
+  {
+    uint64_t tail;
+
+    if (finished_) {
+      return;
+    }
+
+    finished_ = true;
+    __sync_synchronize();
+    while (writers_) {
+      sched_yield();
+    }
+
+    tail = (tail_ < size_) ? tail_ : size_;
+    if (ftruncate(fd_, tail) < 0) {
+      // todo: log error
+    }
+
+    if (dropped_) {
+      std::cout << "Capture: " << path_ << " full, " << dropped_ << " records dropped" << std::endl;
+    }
+  }
+
+  // acceptor thread only, returns the connection's number or 0 if it isn't recorded
+  uint32_t opened(const int fd)
+  {
+    uint32_t conn;
+
+    if ((fd < 0) || (fd >= CAPTURE_MAX_FD)) {
+      return (0);
+    }
+
+    conn = ++next_conn_;
+    conns_[fd] = conn;
+    append(conn, SWISS_CAPTURE_OPEN, NULL, 0);
+
+    return (conn);
+  }
+
+  void received(const int fd, const void *data, const size_t len)
+  {
+    if ((fd < 0) || (fd >= CAPTURE_MAX_FD) || (!conns_[fd])) {
+      return;
+    }
+
+    append(conns_[fd], SWISS_CAPTURE_DATA, data, len);
+  }
+
+  // fd may already belong to a newer connection, whose slot is left alone
+  void closed(const int fd, const uint32_t conn)
+  {
+    if ((fd < 0) || (fd >= CAPTURE_MAX_FD) || (!conn)) {
+      return;
+    }
+
+    append(conn, SWISS_CAPTURE_CLOSE, NULL, 0);
+    __sync_bool_compare_and_swap(&conns_[fd], conn, 0);
+  }
+
+  static void opsRead(void *capture, const int fd, const void *data, const size_t len)
+  {
+    static_cast<Capture *>(capture)->received(fd, data, len);
+  }
+
+private:
+  void append(const uint32_t conn, const uint16_t type, const void *data, const size_t len)
+  {
+    swiss_capture_rec_st *rec;
+    uint64_t size = (sizeof(swiss_capture_rec_st) + len + SWISS_CAPTURE_ALIGN - 1) & 
+      ~((uint64_t)SWISS_CAPTURE_ALIGN - 1);
+    uint64_t offset;
+
+    __sync_fetch_and_add(&writers_, 1);
+    if (finished_) {
+      __sync_fetch_and_sub(&writers_, 1);
+      return;
+    }
+
+    offset = __sync_fetch_and_add(&tail_, size);
+    if (offset + size > size_) {
+      __sync_fetch_and_add(&dropped_, 1);
+      __sync_fetch_and_sub(&writers_, 1);
+      return;
+    }
+
+    rec = (swiss_capture_rec_st *)(base_ + offset);
+    rec->ts_ns = ThreadPool::now() - start_;
+    rec->conn = conn;
+    rec->reserved = 0;
+    rec->len = len;
+    rec->reserved2 = 0;
+    if (len) {
+      memcpy(rec + 1, data, len);
+    }
+    // written last, a reader stops at a record whose type is still 0
+    __sync_synchronize();
+    rec->type = type;
+
+    __sync_fetch_and_sub(&writers_, 1);
+  }
+
+  char path_[256];
+  int fd_;
+  uint8_t *base_;
+  uint64_t size_;
+  volatile uint64_t tail_;
+  uint64_t start_;
+  uint32_t *conns_;
+  uint32_t next_conn_;
+  volatile uint64_t dropped_;
+  volatile uint32_t writers_;
+  volatile bool finished_;
+};
+
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * capture.h
+ *
+ *
+ * Swiss Traffic Capture File Format
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_CAPTURE__
+#define __SWISS_CAPTURE__
+
+#include <stdint.h>
+
+#define SWISS_CAPTURE_MAGIC 0x3150414353495753ULL  // "SWISCAP1"
+#define SWISS_CAPTURE_ALIGN 8
+
+/*
+ * A capture is a header followed by records, each padded to 8 bytes.
+ * Records of a connection appear in the order they happened; records
+ * of different connections may be slightly out of time order. A record
+ * of type 0 (never written) ends the file early.
+ */
+enum {
+  SWISS_CAPTURE_OPEN = 1,  // connection accepted
+  SWISS_CAPTURE_DATA,      // bytes the module read, len of them follow
+  SWISS_CAPTURE_CLOSE      // module returned from work()
+};
+
+typedef struct swiss_capture_hdr_st {
+  uint64_t magic;
+  uint64_t start_ns;       // CLOCK_REALTIME at capture start
+  uint32_t port;
+  uint32_t reserved;
+} swiss_capture_hdr_st;
+
+typedef struct swiss_capture_rec_st {
+  uint64_t ts_ns;          // since capture start
+  uint32_t conn;
+  uint16_t type;
+  uint16_t reserved;
+  uint32_t len;
+  uint32_t reserved2;
+} swiss_capture_rec_st;
+
+#endif
@@ -48,20 +48,123 @@
 #ifndef __SWISS_MODULE__
 #define __SWISS_MODULE__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <netinet/in.h>
 
+// scheduling classes a module may assign in classify()
+enum {
+  SWISS_PRIO_HIGH = 0,
+  SWISS_PRIO_NORMAL,
+  SWISS_PRIO_LOW
+};
+
+/*
+ * Bump allocator owned by the core. Memory is handed out from cur and
+ * the core's grow callback supplies a new chunk once end is reached.
+ * Modules allocate through swiss_arena_alloc in the module library.
+ */
+typedef struct swiss_arena_st {
+  uint8_t *cur;
+  uint8_t *end;
+  void    *(*grow)(struct swiss_arena_st *arena, size_t size);
+  void    *core;
+} swiss_arena_st;
+
 typedef struct swiss_work_st {
   int fd;
   struct sockaddr_in addr;
+  uint32_t priority;
+  uint32_t deadline_us;  // budget from accept, 0 for none
+  void *core;            // reserved for the core
+  swiss_arena_st *arena; // set for work() and work_batch(), freed when they return
   
 } swiss_work_st;
 
 
-extern "C" int load();
+/*
+ * Anchor for state shared by every module in the process. The core
+ * owns it, the module library keeps its maps and reader epochs here.
+ */
+typedef struct swiss_shared_st {
+  pthread_mutex_t   lock;
+  void             *maps;
+  void             *readers;
+  void             *garbage;
+  uint64_t          epoch;
+} swiss_shared_st;
+
+/*
+ * Phase times of a sampled request in CLOCK_MONOTONIC nanoseconds. The
+ * core stamps the phases, the module library adds up time spent in its
+ * I/O wrappers on the request's fd while the module runs.
+ */
+typedef struct swiss_timing_st {
+  uint64_t accepted;
+  uint64_t queued;       // handed to the pool
+  uint64_t started;      // module called
+  uint64_t finished;     // module returned
+  uint64_t read_ns;
+  uint64_t write_ns;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  int32_t  fd;
+  uint32_t reserved;
+} swiss_timing_st;
+
+/*
+ * Services the core hands to a module. A table with only shared set is
+ * handed over before the module's load() runs, and a complete one
+ * replaces it before the module's server takes its first connection.
+ * Neither changes once handed over. The module library picks these up
+ * through swiss_core_init, modules use the library wrappers rather
+ * than calling through it directly.
+ */
+typedef struct swiss_core_ops_st {
+  void     *pool;
+  uint32_t  threads;
+  void   *(*group_create)(void *pool);
+  void    (*group_run)(void *group, void (*fp)(void *), void **opaques, const size_t count);
+  void    (*group_wait)(void *group);
+  void    (*group_destroy)(void *group);
+  void     *capture;     // NULL unless the server is capturing traffic
+  void    (*capture_read)(void *capture, const int fd, const void *data, const size_t len);
+  swiss_shared_st *shared;
+  void     *timing;      // NULL unless the server samples request timings
+  swiss_timing_st *(*timing_find)(void *timing, const int fd);
+} swiss_core_ops_st;
 
-extern "C" void work(void *data);
 
-extern "C" int unload();
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+int load();
+
+void work(void *data);
+
+int unload();
+
+/*
+ * optional, runs on the acceptor thread before the connection is queued
+ * and may set priority and deadline_us. it must not block or read.
+ */
+void classify(swiss_work_st *work);
+
+/*
+ * optional, called instead of work() with connections that were
+ * accepted together. the module owns every item, as with work(), and
+ * the array itself is only valid for the duration of the call.
+ */
+void work_batch(swiss_work_st **works, size_t count);
+
+// optional, provided by the module library
+void swiss_core_init(const swiss_core_ops_st *ops);
+
+#ifdef __cplusplus 
+}
+#endif
 
 
 #endif
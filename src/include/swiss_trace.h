@@ -0,0 +1,89 @@
+/*
+ * swiss_trace.h
+ *
+ *
+ * Swiss Static Tracepoints
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_TRACE__
+#define __SWISS_TRACE__
+
+/*
+ * USDT probes in the "swiss" provider, built in with -DSWISS_USDT
+ * (needs sys/sdt.h from systemtap). A probe site is a nop until a
+ * tracer attaches, e.g. time spent in modules:
+ *
+ *   bpftrace -e 'usdt:./swiss:swiss:module_entry { @t[tid] = nsecs; }
+ *     usdt:./swiss:swiss:module_exit /@t[tid]/ { @us = hist((nsecs - @t[tid]) / 1000); }'
+ *
+ * Without SWISS_USDT they compile away. Arguments are kept to values
+ * already at hand, tracers take their own timestamps. The core probes
+ * are in the swiss binary, the I/O probes in each module's .so since
+ * every module links its own copy of the library.
+ *
+ *   accept(fd, port)           connection accepted
+ *   enqueue(fd, priority)      handed to the pool
+ *   dequeue(fd)                picked up by a pool thread
+ *   module_entry(fd, port)     work() called
+ *   module_exit(fd)            work() returned
+ *   batch_entry(count, port)   work_batch() called
+ *   batch_exit(count)          work_batch() returned
+ *   <io>_entry(fd, len)        a swiss_* I/O call starts, io is one of
+ *   <io>_return(fd, ret)       recv recvfrom read send sendto write
+ *                              writev sendfile
+ */
+#ifdef SWISS_USDT
+
+#include <sys/sdt.h>
+
+#define SWISS_TRACE1(probe, a)       DTRACE_PROBE1(swiss, probe, a)
+#define SWISS_TRACE2(probe, a, b)    DTRACE_PROBE2(swiss, probe, a, b)
+
+#else
+
+#define SWISS_TRACE1(probe, a)       do { } while (0)
+#define SWISS_TRACE2(probe, a, b)    do { } while (0)
+
+#endif
+
+#endif
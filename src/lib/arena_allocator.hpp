@@ -0,0 +1,137 @@
+/*
+ * arena_allocator.hpp
+ *
+ *
+ * Swiss Module Request Arena STL Allocator
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_ARENA_ALLOCATOR__
+#define __SWISS_ARENA_ALLOCATOR__
+
+#include <cstddef>
+#include <new>
+
+#include "arena_lib.h"
+
+
+/*
+ * STL allocator over a request's arena, e.g.
+ *
+ *   swiss_arena_allocator<char> alloc(work->arena);
+ *   std::vector<char, swiss_arena_allocator<char> > buffer(alloc);
+ *
+ * deallocate is a no-op, the arena is released as a whole, so such
+ * containers must not outlive the request.
+ */
+template <typename T>
+class swiss_arena_allocator {
+
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef swiss_arena_allocator<U> other;
+  };
+
+  explicit swiss_arena_allocator(swiss_arena_st *arena) : arena_(arena) {}
+
+  template <typename U>
+  swiss_arena_allocator(const swiss_arena_allocator<U> &other) : arena_(other.arena()) {}
+
+  T *allocate(size_type n)
+  {
+    void *ptr;
+
+    if ((n > (size_type)-1 / sizeof(T)) || ((ptr = swiss_arena_alloc(arena_, n * sizeof(T))) == NULL)) {
+      throw std::bad_alloc();
+    }
+
+    return (static_cast<T *>(ptr));
+  }
+
+  void deallocate(T *, size_type) {}
+
+  size_type max_size() const
+  {
+    return ((size_type)-1 / sizeof(T));
+  }
+
+  void construct(T *p, const T &value)
+  {
+    new ((void *)p) T(value);
+  }
+
+  void destroy(T *p)
+  {
+    p->~T();
+  }
+
+  swiss_arena_st *arena() const
+  {
+    return (arena_);
+  }
+
+private:
+  swiss_arena_st *arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const swiss_arena_allocator<T> &a, const swiss_arena_allocator<U> &b)
+{
+  return (a.arena() == b.arena());
+}
+
+template <typename T, typename U>
+bool operator!=(const swiss_arena_allocator<T> &a, const swiss_arena_allocator<U> &b)
+{
+  return (a.arena() != b.arena());
+}
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ * cache_lib.c
+ *
+ *
+ * Swiss Module Response Cache
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+
+#include "cache_lib.h"
+
+
+typedef struct cache_entry_st {
+  struct cache_entry_st *chain;
+  struct cache_entry_st *next;
+  struct cache_entry_st *prev;
+  uint64_t      hash;
+  uint64_t      expires;
+  size_t        charge;
+  swiss_buf_st *buf;
+  uint8_t       referenced;
+  size_t        key_len;
+  uint8_t       key[];
+} cache_entry_st;
+
+typedef struct cache_shard_st {
+  pthread_mutex_t  lock;
+  cache_entry_st **buckets;
+  uint32_t         mask;
+  uint32_t         count;
+  cache_entry_st  *hand;
+  size_t           bytes;
+  size_t           budget;
+  uint64_t         hits;
+  uint64_t         misses;
+  uint64_t         inserts;
+  uint64_t         evictions;
+  uint64_t         expirations;
+} __attribute__((aligned(64))) cache_shard_st;
+
+struct swiss_cache_st {
+  uint32_t        mask;
+  cache_shard_st *shards;
+};
+
+
+#define CACHE_INITIAL_BUCKETS 64
+#define CACHE_MAX_SHARDS      (1U << 16)
+
+
+static uint64_t cache_hash(const uint8_t *key, const size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  size_t   i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= key[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return (hash);
+}
+
+
+static uint64_t cache_now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+swiss_buf_st *swiss_buf_alloc(const size_t len)
+{
+  swiss_buf_st *buf;
+
+  if ((buf = (swiss_buf_st *)malloc(sizeof(swiss_buf_st) + len)) == NULL) {
+    return (NULL);
+  }
+
+  buf->refs = 1;
+  buf->len = len;
+  buf->data = (uint8_t *)(buf + 1);
+
+  return (buf);
+}
+
+
+swiss_buf_st *swiss_buf_copy(const uint8_t *data, const size_t len)
+{
+  swiss_buf_st *buf;
+
+  if ((buf = swiss_buf_alloc(len)) != NULL) {
+    memcpy(buf->data, data, len);
+  }
+
+  return (buf);
+}
+
+
+swiss_buf_st *swiss_buf_ref(swiss_buf_st *buf)
+{
+  if (buf) {
+    __sync_add_and_fetch(&buf->refs, 1);
+  }
+
+  return (buf);
+}
+
+
+void swiss_buf_release(swiss_buf_st *buf)
+{
+  if ((buf) && (__sync_sub_and_fetch(&buf->refs, 1) == 0)) {
+    free(buf);
+  }
+}
+
+
+swiss_cache_st *swiss_cache_create(const uint32_t shards, const size_t budget)
+{
+  swiss_cache_st *cache;
+  uint32_t        count = 1;
+  uint32_t        i;
+
+  if (!budget) {
+    return (NULL);
+  }
+
+  // rounding past the cap would overflow count
+  while (count < ((shards < CACHE_MAX_SHARDS) ? shards : CACHE_MAX_SHARDS)) {
+    count <<= 1;
+  }
+
+  if ((cache = (swiss_cache_st *)malloc(sizeof(swiss_cache_st))) == NULL) {
+    return (NULL);
+  }
+
+  if (posix_memalign((void **)&cache->shards, 64, count * sizeof(cache_shard_st)) != 0) {
+    free(cache);
+    return (NULL);
+  }
+
+  cache->mask = count - 1;
+  memset(cache->shards, 0, count * sizeof(cache_shard_st));
+
+  for (i = 0; i < count; ++i) {
+    cache_shard_st *shard = &cache->shards[i];
+
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->budget = budget / count;
+    shard->mask = CACHE_INITIAL_BUCKETS - 1;
+    shard->buckets = (cache_entry_st **)calloc(CACHE_INITIAL_BUCKETS, sizeof(cache_entry_st *));
+
+    if (!shard->buckets) {
+      while (i--) {
+	free(cache->shards[i].buckets);
+	pthread_mutex_destroy(&cache->shards[i].lock);
+      }
+      pthread_mutex_destroy(&shard->lock);
+      free(cache->shards);
+      free(cache);
+      return (NULL);
+    }
+  }
+
+  return (cache);
+}
+
+
+static void cache_unlink(cache_shard_st *shard, cache_entry_st *entry)
+{
+  cache_entry_st **link = &shard->buckets[entry->hash & shard->mask];
+
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+
+  if (entry->next == entry) {
+    shard->hand = NULL;
+  } else {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    if (shard->hand == entry) {
+      shard->hand = entry->next;
+    }
+  }
+
+  shard->bytes -= entry->charge;
+  --shard->count;
+
+  swiss_buf_release(entry->buf);
+  free(entry);
+}
+
+
+static cache_entry_st *cache_find(cache_shard_st *shard, const uint64_t hash, 
+				  const uint8_t *key, const size_t key_len)
+{
+  cache_entry_st *entry = shard->buckets[hash & shard->mask];
+
+  while (entry) {
+    if ((entry->hash == hash) && (entry->key_len == key_len) && 
+	(memcmp(entry->key, key, key_len) == 0)) {
+      return (entry);
+    }
+    entry = entry->chain;
+  }
+
+  return (NULL);
+}
+
+
+static void cache_grow(cache_shard_st *shard)
+{
+  cache_entry_st **buckets;
+  uint32_t         mask = (shard->mask << 1) | 1;
+  uint32_t         i;
+
+  if ((buckets = (cache_entry_st **)calloc(mask + 1, sizeof(cache_entry_st *))) == NULL) {
+    // keep the old table, chains just get longer
+    return;
+  }
+
+  for (i = 0; i <= shard->mask; ++i) {
+    cache_entry_st *entry = shard->buckets[i];
+
+    while (entry) {
+      cache_entry_st *chain = entry->chain;
+
+      entry->chain = buckets[entry->hash & mask];
+      buckets[entry->hash & mask] = entry;
+      entry = chain;
+    }
+  }
+
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->mask = mask;
+}
+
+
+/*
+ * advance the clock hand until the shard has room for charge more bytes.
+ * expired entries go first, referenced entries get a second chance.
+ */
+static void cache_evict(cache_shard_st *shard, const size_t charge, const uint64_t now)
+{
+  while ((shard->hand) && (shard->bytes + charge > shard->budget)) {
+    cache_entry_st *entry = shard->hand;
+
+    if ((entry->expires) && (entry->expires <= now)) {
+      ++shard->expirations;
+      cache_unlink(shard, entry);
+    } else if (entry->referenced) {
+      entry->referenced = 0;
+      shard->hand = entry->next;
+    } else {
+      ++shard->evictions;
+      cache_unlink(shard, entry);
+    }
+  }
+}
+
+
+static inline cache_shard_st *cache_shard(swiss_cache_st *cache, const uint64_t hash)
+{
+  return (&cache->shards[(hash >> 40) & cache->mask]);
+}
+
+
+swiss_buf_st *swiss_cache_get(swiss_cache_st *cache, const uint8_t *key, const size_t key_len)
+{
+  cache_shard_st *shard;
+  cache_entry_st *entry;
+  swiss_buf_st   *buf = NULL;
+  uint64_t        hash;
+
+  if ((!cache) || (!key)) {
+    return (NULL);
+  }
+
+  hash = cache_hash(key, key_len);
+  shard = cache_shard(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  if ((entry = cache_find(shard, hash, key, key_len)) != NULL) {
+    if ((entry->expires) && (entry->expires <= cache_now_ms())) {
+      ++shard->expirations;
+      cache_unlink(shard, entry);
+    } else {
+      entry->referenced = 1;
+      buf = swiss_buf_ref(entry->buf);
+    }
+  }
+
+  if (buf) {
+    ++shard->hits;
+  } else {
+    ++shard->misses;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return (buf);
+}
+
+
+int swiss_cache_put(swiss_cache_st *cache, const uint8_t *key, const size_t key_len, 
+		    swiss_buf_st *buf, const uint32_t ttl_ms)
+{
+  cache_shard_st *shard;
+  cache_entry_st *entry;
+  cache_entry_st *old;
+  uint64_t        hash;
+  uint64_t        now;
+  size_t          charge;
+
+  if ((!cache) || (!key) || (!buf)) {
+    return (-1);
+  }
+
+  hash = cache_hash(key, key_len);
+  shard = cache_shard(cache, hash);
+  charge = sizeof(cache_entry_st) + key_len + sizeof(swiss_buf_st) + buf->len;
+
+  if (charge > shard->budget) {
+    return (-1);
+  }
+
+  if ((entry = (cache_entry_st *)malloc(sizeof(cache_entry_st) + key_len)) == NULL) {
+    return (-1);
+  }
+
+  now = cache_now_ms();
+  entry->hash = hash;
+  entry->expires = ttl_ms ? now + ttl_ms : 0;
+  entry->charge = charge;
+  entry->buf = swiss_buf_ref(buf);
+  entry->referenced = 0;
+  entry->key_len = key_len;
+  memcpy(entry->key, key, key_len);
+
+  pthread_mutex_lock(&shard->lock);
+  if ((old = cache_find(shard, hash, key, key_len)) != NULL) {
+    cache_unlink(shard, old);
+  }
+
+  cache_evict(shard, charge, now);
+
+  if (shard->count >= shard->mask + 1) {
+    cache_grow(shard);
+  }
+
+  entry->chain = shard->buckets[hash & shard->mask];
+  shard->buckets[hash & shard->mask] = entry;
+
+  // new entries go just behind the hand so they get a full sweep
+  if (shard->hand) {
+    entry->next = shard->hand;
+    entry->prev = shard->hand->prev;
+    entry->prev->next = entry;
+    shard->hand->prev = entry;
+  } else {
+    entry->next = entry;
+    entry->prev = entry;
+    shard->hand = entry;
+  }
+
+  shard->bytes += charge;
+  ++shard->count;
+  ++shard->inserts;
+  pthread_mutex_unlock(&shard->lock);
+
+  return (0);
+}
+
+
+int swiss_cache_remove(swiss_cache_st *cache, const uint8_t *key, const size_t key_len)
+{
+  cache_shard_st *shard;
+  cache_entry_st *entry;
+  uint64_t        hash;
+
+  if ((!cache) || (!key)) {
+    return (-1);
+  }
+
+  hash = cache_hash(key, key_len);
+  shard = cache_shard(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  if ((entry = cache_find(shard, hash, key, key_len)) != NULL) {
+    cache_unlink(shard, entry);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return (entry ? 0 : -1);
+}
+
+
+void swiss_cache_stats(swiss_cache_st *cache, swiss_cache_stats_st *stats)
+{
+  uint32_t i;
+
+  if ((!cache) || (!stats)) {
+    return;
+  }
+
+  memset(stats, 0, sizeof(swiss_cache_stats_st));
+
+  for (i = 0; i <= cache->mask; ++i) {
+    cache_shard_st *shard = &cache->shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->inserts += shard->inserts;
+    stats->evictions += shard->evictions;
+    stats->expirations += shard->expirations;
+    stats->entries += shard->count;
+    stats->bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+
+void swiss_cache_destroy(swiss_cache_st *cache)
+{
+  uint32_t i;
+
+  if (!cache) {
+    return;
+  }
+
+  for (i = 0; i <= cache->mask; ++i) {
+    cache_shard_st *shard = &cache->shards[i];
+
+    while (shard->hand) {
+      cache_unlink(shard, shard->hand);
+    }
+
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(cache->shards);
+  free(cache);
+}
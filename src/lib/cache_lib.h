@@ -0,0 +1,112 @@
+/*
+ * cache_lib.h
+ *
+ *
+ * Swiss Module Response Cache
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_CACHE_LIB__
+#define __SWISS_CACHE_LIB__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/*
+ * Reference counted, immutable response buffer. A buffer handed out by
+ * the cache stays valid until the caller releases it, even if the entry
+ * is evicted or replaced in the meantime, so data/len can be passed
+ * directly to swiss_write/swiss_writev without copying.
+ */
+typedef struct swiss_buf_st {
+  volatile uint32_t refs;
+  size_t   len;
+  uint8_t *data;
+} swiss_buf_st;
+
+swiss_buf_st *swiss_buf_alloc(const size_t len);
+swiss_buf_st *swiss_buf_copy(const uint8_t *data, const size_t len);
+swiss_buf_st *swiss_buf_ref(swiss_buf_st *buf);
+void swiss_buf_release(swiss_buf_st *buf);
+
+
+typedef struct swiss_cache_stats_st {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t inserts;
+  uint64_t evictions;
+  uint64_t expirations;
+  uint64_t entries;
+  uint64_t bytes;
+} swiss_cache_stats_st;
+
+typedef struct swiss_cache_st swiss_cache_st;
+
+/*
+ * shards is rounded up to a power of two, budget is the total number of
+ * bytes (keys, payloads and bookkeeping) the cache may hold. Entries are
+ * evicted with the CLOCK algorithm once a shard exceeds its share.
+ */
+swiss_cache_st *swiss_cache_create(const uint32_t shards, const size_t budget);
+void swiss_cache_destroy(swiss_cache_st *cache);
+
+/* returns a new reference on hit, NULL on miss */
+swiss_buf_st *swiss_cache_get(swiss_cache_st *cache, const uint8_t *key, const size_t key_len);
+
+/* takes its own reference on buf, ttl_ms of 0 never expires */
+int swiss_cache_put(swiss_cache_st *cache, const uint8_t *key, const size_t key_len, 
+		    swiss_buf_st *buf, const uint32_t ttl_ms);
+int swiss_cache_remove(swiss_cache_st *cache, const uint8_t *key, const size_t key_len);
+
+void swiss_cache_stats(swiss_cache_st *cache, swiss_cache_stats_st *stats);
+
+
+#ifdef __cplusplus 
+}
+#endif
+
+
+#endif
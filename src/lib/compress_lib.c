@@ -0,0 +1,663 @@
+/*
+ * compress_lib.c
+ *
+ *
+ * Swiss Module Compression Library
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef SWISS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+#include "module_lib.h"
+#include "compress_lib.h"
+
+
+// output is handed to swiss_write in pieces of this size when streaming
+#define COMPRESS_CHUNK (16 * 1024)
+#define COMPRESS_KEY_LEN 26
+#define COMPRESS_ZSTD_DEFAULT 3
+
+
+typedef struct compress_ctx_st {
+  int       coding;
+  int       level;
+  z_stream  zs;         // gzip and deflate
+#ifdef SWISS_HAVE_ZSTD
+  ZSTD_CCtx *zc;
+#endif
+} compress_ctx_st;
+
+struct swiss_compress_st {
+  int              fd;
+  int              error;
+  int64_t          written;
+  compress_ctx_st *ctx;
+  uint8_t          out[COMPRESS_CHUNK];
+};
+
+enum {
+  COMPRESS_CONTINUE = 0,
+  COMPRESS_FLUSH,
+  COMPRESS_END
+};
+
+
+static const char *compress_names[SWISS_COMPRESS_CODINGS] = { "gzip", "deflate", "zstd" };
+
+// one idle context per coding and thread
+static __thread compress_ctx_st *compress_idle[SWISS_COMPRESS_CODINGS];
+static pthread_key_t compress_key;
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+static uint64_t compress_seed[2];
+
+
+/*
+ * Contexts
+ */
+
+static void compress_ctx_free(compress_ctx_st *ctx)
+{
+  if (ctx->coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    ZSTD_freeCCtx(ctx->zc);
+#endif
+  } else {
+    deflateEnd(&ctx->zs);
+  }
+  free(ctx);
+}
+
+
+static void compress_thread_exit(void *idle)
+{
+  compress_ctx_st **ctxs = (compress_ctx_st **)idle;
+  int i;
+
+  for (i = 0; i < SWISS_COMPRESS_CODINGS; ++i) {
+    if (ctxs[i]) {
+      compress_ctx_free(ctxs[i]);
+      ctxs[i] = NULL;
+    }
+  }
+}
+
+
+/*
+ * the cache key's hash is SipHash keyed with a random per process seed,
+ * so payloads that collide can't be found without the seed and used to
+ * poison the cache
+ */
+static void compress_init()
+{
+  int fd;
+
+  pthread_key_create(&compress_key, compress_thread_exit);
+
+  compress_seed[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  compress_seed[1] = (uint64_t)(uintptr_t)&compress_seed ^ (uint64_t)clock();
+
+  if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) >= 0) {
+    if (read(fd, compress_seed, sizeof(compress_seed)) != sizeof(compress_seed)) {
+      // todo: log error, the fallback seed above stays
+    }
+    close(fd);
+  }
+}
+
+
+static int compress_level(const int coding, const int level)
+{
+  if (coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    if (level > ZSTD_maxCLevel()) {
+      return (ZSTD_maxCLevel());
+    }
+#endif
+    return ((level <= 0) ? COMPRESS_ZSTD_DEFAULT : level);
+  }
+
+  if (level > Z_BEST_COMPRESSION) {
+    return (Z_BEST_COMPRESSION);
+  }
+  return ((level < 0) ? Z_DEFAULT_COMPRESSION : level);
+}
+
+
+static compress_ctx_st *compress_ctx_new(const int coding, const int level)
+{
+  compress_ctx_st *ctx;
+
+  if ((ctx = (compress_ctx_st *)calloc(1, sizeof(compress_ctx_st))) == NULL) {
+    return (NULL);
+  }
+
+  ctx->coding = coding;
+  ctx->level = level;
+
+  if (coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    if ((ctx->zc = ZSTD_createCCtx()) != NULL) {
+      ZSTD_CCtx_setParameter(ctx->zc, ZSTD_c_compressionLevel, level);
+      return (ctx);
+    }
+#endif
+    free(ctx);
+    return (NULL);
+  }
+
+  // windowBits + 16 asks zlib for a gzip wrapper instead of a zlib one
+  if (deflateInit2(&ctx->zs, level, Z_DEFLATED, (coding == SWISS_COMPRESS_GZIP) ? 15 + 16 : 15, 
+		   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(ctx);
+    return (NULL);
+  }
+
+  return (ctx);
+}
+
+
+// a ready context, the thread's idle one if it has it
+static compress_ctx_st *compress_ctx_take(const int coding, const int level)
+{
+  compress_ctx_st *ctx;
+
+  if (!swiss_compress_supported(coding)) {
+    return (NULL);
+  }
+
+  pthread_once(&compress_once, compress_init);
+
+  if ((ctx = compress_idle[coding]) == NULL) {
+    return (compress_ctx_new(coding, compress_level(coding, level)));
+  }
+
+  compress_idle[coding] = NULL;
+
+  if (coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    ZSTD_CCtx_reset(ctx->zc, ZSTD_reset_session_only);
+    if (ctx->level != compress_level(coding, level)) {
+      ctx->level = compress_level(coding, level);
+      ZSTD_CCtx_setParameter(ctx->zc, ZSTD_c_compressionLevel, ctx->level);
+    }
+#endif
+  } else {
+    deflateReset(&ctx->zs);
+    if ((ctx->level != compress_level(coding, level)) &&
+	(deflateParams(&ctx->zs, compress_level(coding, level), Z_DEFAULT_STRATEGY) == Z_OK)) {
+      ctx->level = compress_level(coding, level);
+    }
+  }
+
+  return (ctx);
+}
+
+
+// keeps ctx for the calling thread's next use, a stream may be closed on another thread
+static void compress_ctx_give(compress_ctx_st *ctx)
+{
+  if (compress_idle[ctx->coding]) {
+    compress_ctx_free(ctx);
+    return;
+  }
+
+  compress_idle[ctx->coding] = ctx;
+  pthread_setspecific(compress_key, compress_idle);
+}
+
+
+/*
+ * Codings
+ */
+
+int swiss_compress_supported(const int coding)
+{
+#ifdef SWISS_HAVE_ZSTD
+  return ((coding >= 0) && (coding < SWISS_COMPRESS_CODINGS));
+#else
+  return ((coding == SWISS_COMPRESS_GZIP) || (coding == SWISS_COMPRESS_DEFLATE));
+#endif
+}
+
+
+const char *swiss_compress_name(const int coding)
+{
+  if ((coding < 0) || (coding >= SWISS_COMPRESS_CODINGS)) {
+    return (NULL);
+  }
+
+  return (compress_names[coding]);
+}
+
+
+/*
+ * how an Accept-Encoding value treats token: 1 accepted, 0 refused
+ * with q=0, -1 not listed
+ */
+static int compress_accepts(const char *header, const char *token)
+{
+  size_t token_len = strlen(token);
+  const char *item = header;
+  const char *q;
+  const char *end;
+
+  while (*item) {
+    while ((*item == ' ') || (*item == '\t') || (*item == ',')) {
+      ++item;
+    }
+
+    if ((end = strchr(item, ',')) == NULL) {
+      end = item + strlen(item);
+    }
+
+    if ((strncasecmp(item, token, token_len) == 0) && 
+	((item + token_len == end) || (strchr(" \t;", item[token_len])))) {
+      if (((q = strchr(item, ';')) != NULL) && (q < end)) {
+	while ((q < end) && (*q != 'q') && (*q != 'Q')) {
+	  ++q;
+	}
+	if ((q + 1 < end) && (q[1] == '=')) {
+	  return ((strtod(q + 2, NULL) > 0) ? 1 : 0);
+	}
+      }
+      return (1);
+    }
+
+    item = end;
+  }
+
+  return (-1);
+}
+
+
+int swiss_compress_accepts(const char *accept_encoding, const char *token)
+{
+  int accepts;
+
+  if ((!accept_encoding) || (!token)) {
+    return (0);
+  }
+
+  if ((accepts = compress_accepts(accept_encoding, token)) == -1) {
+    accepts = (compress_accepts(accept_encoding, "*") == 1);
+  }
+
+  return (accepts);
+}
+
+
+int swiss_compress_negotiate(const char *accept_encoding)
+{
+  static const int preference[] = { SWISS_COMPRESS_ZSTD, SWISS_COMPRESS_GZIP, SWISS_COMPRESS_DEFLATE };
+  unsigned int i;
+
+  if (!accept_encoding) {
+    return (SWISS_COMPRESS_NONE);
+  }
+
+  for (i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i) {
+    if ((swiss_compress_supported(preference[i])) && 
+	(swiss_compress_accepts(accept_encoding, compress_names[preference[i]]))) {
+      return (preference[i]);
+    }
+  }
+
+  return (SWISS_COMPRESS_NONE);
+}
+
+
+/*
+ * One shot
+ */
+
+static inline uint64_t compress_rotl(const uint64_t x, const int r)
+{
+  return ((x << r) | (x >> (64 - r)));
+}
+
+
+static inline void compress_sipround(uint64_t *v)
+{
+  v[0] += v[1];
+  v[1] = compress_rotl(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = compress_rotl(v[0], 32);
+  v[2] += v[3];
+  v[3] = compress_rotl(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = compress_rotl(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = compress_rotl(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = compress_rotl(v[2], 32);
+}
+
+
+// SipHash-2-4 with the 128 bit output, keyed by the process seed
+static void compress_hash(const uint8_t *data, const size_t len, uint64_t *hash)
+{
+  uint64_t v[4];
+  uint64_t word;
+  size_t i;
+
+  v[0] = 0x736f6d6570736575ULL ^ compress_seed[0];
+  v[1] = 0x646f72616e646f6dULL ^ compress_seed[1] ^ 0xee;
+  v[2] = 0x6c7967656e657261ULL ^ compress_seed[0];
+  v[3] = 0x7465646279746573ULL ^ compress_seed[1];
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&word, data + i, 8);
+    v[3] ^= word;
+    compress_sipround(v);
+    compress_sipround(v);
+    v[0] ^= word;
+  }
+
+  word = 0;
+  memcpy(&word, data + i, len - i);
+  word |= (uint64_t)len << 56;
+  v[3] ^= word;
+  compress_sipround(v);
+  compress_sipround(v);
+  v[0] ^= word;
+
+  v[2] ^= 0xee;
+  for (i = 0; i < 4; ++i) {
+    compress_sipround(v);
+  }
+  hash[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+
+  v[1] ^= 0xdd;
+  for (i = 0; i < 4; ++i) {
+    compress_sipround(v);
+  }
+  hash[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+
+static void compress_make_key(uint8_t *key, const int coding, const int level, 
+			      const uint8_t *data, const size_t len)
+{
+  uint64_t hash[2];
+  uint64_t size = len;
+
+  compress_hash(data, len, hash);
+
+  key[0] = (uint8_t)coding;
+  key[1] = (uint8_t)(level + 1);
+  memcpy(key + 2, &size, sizeof(size));
+  memcpy(key + 10, hash, sizeof(hash));
+}
+
+
+static swiss_buf_st *compress_once_buf(const int coding, const int level, 
+				       const uint8_t *data, const size_t len)
+{
+  compress_ctx_st *ctx;
+  swiss_buf_st *out;
+  swiss_buf_st *buf = NULL;
+  size_t olen = 0;
+
+  if ((ctx = compress_ctx_take(coding, level)) == NULL) {
+    return (NULL);
+  }
+
+  if (coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    if ((out = swiss_buf_alloc(ZSTD_compressBound(len))) != NULL) {
+      olen = ZSTD_compress2(ctx->zc, out->data, out->len, data, len);
+      if (ZSTD_isError(olen)) {
+	olen = len;
+      }
+    }
+#else
+    out = NULL;
+#endif
+  } else {
+    if ((out = swiss_buf_alloc(deflateBound(&ctx->zs, len))) != NULL) {
+      ctx->zs.next_in = (Bytef *)data;
+      ctx->zs.avail_in = len;
+      ctx->zs.next_out = out->data;
+      ctx->zs.avail_out = out->len;
+      olen = (deflate(&ctx->zs, Z_FINISH) == Z_STREAM_END) ? ctx->zs.total_out : len;
+    }
+  }
+
+  compress_ctx_give(ctx);
+
+  // sized for the worst case, keep an exact copy
+  if ((out) && (olen < len)) {
+    buf = swiss_buf_copy(out->data, olen);
+  }
+  swiss_buf_release(out);
+
+  return (buf);
+}
+
+
+swiss_buf_st *swiss_compress_buf(swiss_cache_st *cache, const int coding, const int level, 
+				 const uint8_t *data, const size_t len)
+{
+  uint8_t key[COMPRESS_KEY_LEN];
+  swiss_buf_st *buf;
+  swiss_buf_st *none;
+
+  if ((!data) || (!len) || (!swiss_compress_supported(coding))) {
+    return (NULL);
+  }
+
+  if (!cache) {
+    return (compress_once_buf(coding, level, data, len));
+  }
+
+  pthread_once(&compress_once, compress_init);
+  compress_make_key(key, coding, compress_level(coding, level), data, len);
+
+  // an empty buffer records that the payload doesn't compress
+  if ((buf = swiss_cache_get(cache, key, sizeof(key))) != NULL) {
+    if (!buf->len) {
+      swiss_buf_release(buf);
+      return (NULL);
+    }
+    return (buf);
+  }
+
+  if ((buf = compress_once_buf(coding, level, data, len)) != NULL) {
+    swiss_cache_put(cache, key, sizeof(key), buf, 0);
+  } else if ((none = swiss_buf_alloc(0)) != NULL) {
+    swiss_cache_put(cache, key, sizeof(key), none, 0);
+    swiss_buf_release(none);
+  }
+
+  return (buf);
+}
+
+
+/*
+ * Streams
+ */
+
+static int compress_emit(swiss_compress_st *stream, const size_t len)
+{
+  if (len) {
+    if (swiss_write(stream->fd, stream->out, len) < 0) {
+      stream->error = 1;
+      return (-1);
+    }
+    stream->written += len;
+  }
+
+  return (0);
+}
+
+
+// runs data through the compressor, writing out each chunk of output
+static int compress_pump(swiss_compress_st *stream, const uint8_t *data, const size_t len, 
+			 const int mode)
+{
+  compress_ctx_st *ctx = stream->ctx;
+  int ret;
+
+  if (stream->error) {
+    return (-1);
+  }
+
+  if (ctx->coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    static const ZSTD_EndDirective directives[] = { ZSTD_e_continue, ZSTD_e_flush, ZSTD_e_end };
+    ZSTD_inBuffer in = { data, len, 0 };
+    size_t remaining;
+
+    do {
+      ZSTD_outBuffer out = { stream->out, COMPRESS_CHUNK, 0 };
+
+      remaining = ZSTD_compressStream2(ctx->zc, &out, &in, directives[mode]);
+      if ((ZSTD_isError(remaining)) || (compress_emit(stream, out.pos) < 0)) {
+	stream->error = 1;
+	return (-1);
+      }
+    } while ((mode == COMPRESS_CONTINUE) ? (in.pos < in.size) : (remaining != 0));
+
+    return (0);
+#else
+    return (-1);
+#endif
+  }
+
+  ctx->zs.next_in = (Bytef *)data;
+  ctx->zs.avail_in = len;
+
+  do {
+    ctx->zs.next_out = stream->out;
+    ctx->zs.avail_out = COMPRESS_CHUNK;
+
+    ret = deflate(&ctx->zs, (mode == COMPRESS_END) ? Z_FINISH : 
+		  ((mode == COMPRESS_FLUSH) ? Z_SYNC_FLUSH : Z_NO_FLUSH));
+    if (((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) ||
+	(compress_emit(stream, COMPRESS_CHUNK - ctx->zs.avail_out) < 0)) {
+      stream->error = 1;
+      return (-1);
+    }
+    // a full output chunk means deflate may have more to give
+  } while ((ctx->zs.avail_out == 0) || ((mode == COMPRESS_END) && (ret != Z_STREAM_END)));
+
+  return (0);
+}
+
+
+swiss_compress_st *swiss_compress_open(const int fd, const int coding, const int level)
+{
+  swiss_compress_st *stream;
+
+  if ((fd == -1) || ((stream = (swiss_compress_st *)malloc(sizeof(swiss_compress_st))) == NULL)) {
+    return (NULL);
+  }
+
+  if ((stream->ctx = compress_ctx_take(coding, level)) == NULL) {
+    free(stream);
+    return (NULL);
+  }
+
+  stream->fd = fd;
+  stream->error = 0;
+  stream->written = 0;
+
+  return (stream);
+}
+
+
+int swiss_compress_write(swiss_compress_st *stream, const uint8_t *data, const size_t len)
+{
+  if ((!stream) || ((!data) && (len))) {
+    return (-1);
+  }
+
+  if (!len) {
+    return (0);
+  }
+
+  return ((compress_pump(stream, data, len, COMPRESS_CONTINUE) < 0) ? -1 : (int)len);
+}
+
+
+int swiss_compress_flush(swiss_compress_st *stream)
+{
+  if (!stream) {
+    return (-1);
+  }
+
+  return (compress_pump(stream, NULL, 0, COMPRESS_FLUSH));
+}
+
+
+int64_t swiss_compress_close(swiss_compress_st *stream)
+{
+  int64_t written;
+
+  if (!stream) {
+    return (-1);
+  }
+
+  compress_pump(stream, NULL, 0, COMPRESS_END);
+  written = stream->error ? -1 : stream->written;
+
+  // taking a context resets it, even one left mid stream by an error
+  compress_ctx_give(stream->ctx);
+  free(stream);
+
+  return (written);
+}
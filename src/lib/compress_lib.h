@@ -0,0 +1,129 @@
+/*
+ * compress_lib.h
+ *
+ *
+ * Swiss Module Compression Library
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_COMPRESS_LIB__
+#define __SWISS_COMPRESS_LIB__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cache_lib.h"
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/*
+ * gzip and deflate come from zlib, zstd is built in with
+ * -DSWISS_HAVE_ZSTD (and -lzstd). Modules using this link -lz.
+ * Compressor contexts are kept per thread and reset between uses, so
+ * a request pays for setting one up only the first time its thread
+ * compresses with that coding.
+ */
+enum {
+  SWISS_COMPRESS_NONE = -1,
+  SWISS_COMPRESS_GZIP = 0,
+  SWISS_COMPRESS_DEFLATE,
+  SWISS_COMPRESS_ZSTD,
+  SWISS_COMPRESS_CODINGS
+};
+
+// the coding's own default, i.e. 6 for zlib and 3 for zstd
+#define SWISS_COMPRESS_LEVEL_DEFAULT -1
+
+/* 1 if the coding is compiled in */
+int swiss_compress_supported(const int coding);
+
+/* the Content-Encoding token for coding */
+const char *swiss_compress_name(const int coding);
+
+/*
+ * 1 if an Accept-Encoding value allows the content coding token (say
+ * "br" for a precompressed file), either listed with q > 0 or through
+ * "*" when not listed at all
+ */
+int swiss_compress_accepts(const char *accept_encoding, const char *token);
+
+/*
+ * the preferred coding an Accept-Encoding value allows (zstd, then
+ * gzip, then deflate), SWISS_COMPRESS_NONE if it allows none
+ */
+int swiss_compress_negotiate(const char *accept_encoding);
+
+/*
+ * Compresses a whole payload. With a cache the result is stored keyed
+ * by the coding, level and a 128 bit hash of the content, so a hot
+ * response is compressed once and served from the cache after that.
+ * Returns a reference the caller releases, or NULL if compression
+ * failed or wouldn't make the payload smaller (remembered in the cache
+ * too); the payload is then best sent as is.
+ */
+swiss_buf_st *swiss_compress_buf(swiss_cache_st *cache, const int coding, const int level, 
+				 const uint8_t *data, const size_t len);
+
+/*
+ * Streams compressed output to fd through swiss_write as data is
+ * written, for responses that are produced piecemeal or too large to
+ * hold. Framing (i.e. chunked encoding) is up to the module. close
+ * ends the stream and frees it, returning the compressed bytes
+ * written or -1 if any write failed.
+ */
+typedef struct swiss_compress_st swiss_compress_st;
+
+swiss_compress_st *swiss_compress_open(const int fd, const int coding, const int level);
+int swiss_compress_write(swiss_compress_st *stream, const uint8_t *data, const size_t len);
+/* pushes out everything written so far, i.e. before waiting on an upstream */
+int swiss_compress_flush(swiss_compress_st *stream);
+int64_t swiss_compress_close(swiss_compress_st *stream);
+
+
+#ifdef __cplusplus 
+}
+#endif
+
+
+#endif
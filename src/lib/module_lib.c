@@ -47,34 +47,112 @@
 
 
 #include <unistd.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 
 #include "module_lib.h"
+#include "../include/swiss_trace.h"
 
 
+const swiss_core_ops_st *swiss_core_ops = NULL;
+
+
+// the table is filled in before it is handed over, the store publishes all of it
+void swiss_core_init(const swiss_core_ops_st *ops)
+{
+  __atomic_store_n(&swiss_core_ops, ops, __ATOMIC_RELEASE);
+}
+
+
+// hands what was read to the core when it is capturing traffic
+static inline void captureRead(int fd, const uint8_t *buffer, int32_t len)
+{
+  const swiss_core_ops_st *ops = swiss_core();
+
+  if ((len > 0) && (ops) && (ops->capture)) {
+    ops->capture_read(ops->capture, fd, buffer, len);
+  }
+}
+
+
+static inline uint64_t timingNow()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+
+// finds the sampled request fd belongs to, if any, and stamps the start of the call
+static inline uint64_t timingStart(const int fd, swiss_timing_st **timing)
+{
+  const swiss_core_ops_st *ops = swiss_core();
+
+  *timing = NULL;
+
+  if ((ops) && (ops->timing) && ((*timing = ops->timing_find(ops->timing, fd)) != NULL)) {
+    return (timingNow());
+  }
+
+  return (0);
+}
+
+
+static inline void timingRead(swiss_timing_st *timing, const uint64_t start, const int32_t bytes)
+{
+  if (timing) {
+    timing->read_ns += timingNow() - start;
+    timing->read_bytes += (bytes > 0) ? bytes : 0;
+  }
+}
+
+
+static inline void timingWrite(swiss_timing_st *timing, const uint64_t start, const uint64_t bytes)
+{
+  if (timing) {
+    timing->write_ns += timingNow() - start;
+    timing->write_bytes += bytes;
+  }
+}
+
 
 int swiss_recv(int fd, uint8_t *buffer, const size_t len, const int flags)
 {
   int32_t  read_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(recv_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   do {
     if ((read_bytes = recv(fd, buffer, len, flags)) < 0) {
       if (errno != EINTR) {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
   } while (errno == EINTR);
 
+  timingRead(timing, start, read_bytes);
+  SWISS_TRACE2(recv_return, fd, read_bytes);
+
+  // peeked bytes are captured when they are really read
+  if (!(flags & MSG_PEEK)) {
+    captureRead(fd, buffer, read_bytes);
+  }
+
   return (read_bytes);
 }
 
@@ -83,20 +161,32 @@ int swiss_recvfrom(int fd, uint8_t* buffer, const size_t len, const int flags,
 		   struct sockaddr *addr, socklen_t *addrlen)
 {
   int32_t  read_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(recvfrom_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   do {
     if ((read_bytes = recvfrom(fd, buffer, len, flags, addr, addrlen)) < 0) {
       if (errno != EINTR) {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
   } while (errno == EINTR);
+
+  timingRead(timing, start, read_bytes);
+  SWISS_TRACE2(recvfrom_return, fd, read_bytes);
+
+  if (!(flags & MSG_PEEK)) {
+    captureRead(fd, buffer, read_bytes);
+  }
   
   return (read_bytes);
 }
@@ -105,20 +195,30 @@ int swiss_recvfrom(int fd, uint8_t* buffer, const size_t len, const int flags,
 int swiss_read(int fd, uint8_t *buffer, const size_t len)
 {
   int32_t  read_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(read_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   do {
     if ((read_bytes = read(fd, buffer, len)) < 0) {
       if (errno != EINTR) {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
   } while (errno == EINTR);
+
+  timingRead(timing, start, read_bytes);
+  SWISS_TRACE2(read_return, fd, read_bytes);
+
+  captureRead(fd, buffer, read_bytes);
   
   return (read_bytes);
 }
@@ -128,27 +228,36 @@ int swiss_send(int fd, const uint8_t *buffer, const size_t len, const int flags)
 {
   uint32_t remaining_bytes = len;
   int32_t  write_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(send_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   while (remaining_bytes > 0) {
     if ((write_bytes = send(fd, buffer, remaining_bytes, flags)) <= 0) {
       if ((errno == EINTR) && (write_bytes < 0)) {
 	write_bytes = 0;
       } else {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
     
     remaining_bytes -= write_bytes;
     buffer += write_bytes;
   }
+
+  timingWrite(timing, start, len - remaining_bytes);
+  write_bytes = (remaining_bytes) ? -1 : (int32_t)len;
+  SWISS_TRACE2(send_return, fd, write_bytes);
   
-  return (len - remaining_bytes);
+  return (write_bytes);
 }
 
 
@@ -157,27 +266,36 @@ int swiss_sendto(int fd, const uint8_t *buffer, const size_t len, const int flag
 {
   uint32_t remaining_bytes = len;
   int32_t  write_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(sendto_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   while (remaining_bytes > 0) {
     if ((write_bytes = sendto(fd, buffer, remaining_bytes, flags, addr, addrlen)) <= 0) {
       if ((errno == EINTR) && (write_bytes < 0)) {
 	write_bytes = 0;
       } else {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
     
     remaining_bytes -= write_bytes;
     buffer += write_bytes;
   }
+
+  timingWrite(timing, start, len - remaining_bytes);
+  write_bytes = (remaining_bytes) ? -1 : (int32_t)len;
+  SWISS_TRACE2(sendto_return, fd, write_bytes);
   
-  return (len - remaining_bytes);
+  return (write_bytes);
 }
 
 
@@ -185,27 +303,136 @@ int swiss_write(int fd, const uint8_t *buffer, const size_t len)
 {
   uint32_t remaining_bytes = len;
   int32_t  write_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
   
   if ((!buffer) || (!len) || (fd == -1)) {
     // todo: log error
     return (-1);
   }
   
+  SWISS_TRACE2(write_entry, fd, len);
+  start = timingStart(fd, &timing);
+  
   while (remaining_bytes > 0) {
     if ((write_bytes = write(fd, buffer, remaining_bytes)) <= 0) {
       if ((errno == EINTR) && (write_bytes < 0)) {
 	write_bytes = 0;
       } else {
 	// todo: log error
-	return (-1);
+	break;
       }
     }
     
     remaining_bytes -= write_bytes;
     buffer += write_bytes;
   }
+
+  timingWrite(timing, start, len - remaining_bytes);
+  write_bytes = (remaining_bytes) ? -1 : (int32_t)len;
+  SWISS_TRACE2(write_return, fd, write_bytes);
+  
+  return (write_bytes);
+}
+
+
+// returns ssize_t, a response gathered from several buffers may not fit in an int
+ssize_t swiss_writev(int fd, const struct iovec *iov, const int iovcnt)
+{
+  struct iovec vec[SWISS_IOV_MAX];
+  struct iovec *cur = vec;
+  int      count = 0;
+  size_t   total = 0;
+  ssize_t  write_bytes;
+  int      i;
+  swiss_timing_st *timing;
+  uint64_t start;
+
+  if ((!iov) || (iovcnt <= 0) || (iovcnt > SWISS_IOV_MAX) || (fd == -1)) {
+    // todo: log error
+    return (-1);
+  }
+
+  // writev may stop short, so work on a copy we are free to advance
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len) {
+      vec[count++] = iov[i];
+      total += iov[i].iov_len;
+    }
+  }
+
+  SWISS_TRACE2(writev_entry, fd, total);
+  start = timingStart(fd, &timing);
+
+  while (count > 0) {
+    if ((write_bytes = writev(fd, cur, count)) <= 0) {
+      if ((errno == EINTR) && (write_bytes < 0)) {
+	write_bytes = 0;
+      } else {
+	// todo: log error
+	break;
+      }
+    }
+
+    while ((count > 0) && ((size_t)write_bytes >= cur->iov_len)) {
+      write_bytes -= cur->iov_len;
+      ++cur;
+      --count;
+    }
+
+    if (count > 0) {
+      cur->iov_base = (uint8_t *)cur->iov_base + write_bytes;
+      cur->iov_len -= write_bytes;
+    }
+  }
+
+  // on error what was left is still counted in cur
+  for (i = 0; i < count; ++i) {
+    total -= cur[i].iov_len;
+  }
+  timingWrite(timing, start, total);
+  write_bytes = (count > 0) ? -1 : (ssize_t)total;
+  SWISS_TRACE2(writev_return, fd, write_bytes);
+
+  return (write_bytes);
+}
+
+
+// returns ssize_t as files may be larger than an int can count
+ssize_t swiss_sendfile(int out_fd, int in_fd, off_t *offset, const size_t len)
+{
+  size_t   remaining_bytes = len;
+  ssize_t  write_bytes;
+  swiss_timing_st *timing;
+  uint64_t start;
+  
+  if ((!offset) || (!len) || (out_fd == -1) || (in_fd == -1)) {
+    // todo: log error
+    return (-1);
+  }
+  
+  SWISS_TRACE2(sendfile_entry, out_fd, len);
+  start = timingStart(out_fd, &timing);
+  
+  while (remaining_bytes > 0) {
+    // sendfile advances *offset itself
+    if ((write_bytes = sendfile(out_fd, in_fd, offset, remaining_bytes)) <= 0) {
+      if ((errno == EINTR) && (write_bytes < 0)) {
+	write_bytes = 0;
+      } else {
+	// todo: log error
+	break;
+      }
+    }
+    
+    remaining_bytes -= write_bytes;
+  }
+
+  timingWrite(timing, start, len - remaining_bytes);
+  write_bytes = (remaining_bytes) ? -1 : (ssize_t)len;
+  SWISS_TRACE2(sendfile_return, out_fd, write_bytes);
   
-  return (len - remaining_bytes);
+  return (write_bytes);
 }
 
 
@@ -49,6 +49,12 @@
 #define __SWISS_MODULE_LIB__
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../include/module.h"
+
+#define SWISS_IOV_MAX 64
 
 #ifdef __cplusplus 
 extern "C" {
@@ -64,11 +70,23 @@ int swiss_send(int fd, const uint8_t *buffer, const size_t len, const int flags)
 int swiss_sendto(int fd, const uint8_t *buffer, const size_t len, const int flags, 
 		 const struct sockaddr *addr, const socklen_t addrlen);
 int swiss_write(int fd, const uint8_t *buffer, const size_t len);
+ssize_t swiss_writev(int fd, const struct iovec *iov, const int iovcnt);
+ssize_t swiss_sendfile(int out_fd, int in_fd, off_t *offset, const size_t len);
 
 
 void swiss_close(int *fd);
 
 
+// set by the core through swiss_core_init, NULL when running standalone
+extern const swiss_core_ops_st *swiss_core_ops;
+
+// the core swaps in a fuller table once the server is up, take one snapshot per use
+static inline const swiss_core_ops_st *swiss_core()
+{
+  return (__atomic_load_n(&swiss_core_ops, __ATOMIC_ACQUIRE));
+}
+
+
 #ifdef __cplusplus 
 }
 #endif
@@ -0,0 +1,961 @@
+/*
+ * state_lib.c
+ *
+ *
+ * Swiss Module Shared State Store
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#include "module_lib.h"
+#include "state_lib.h"
+
+
+typedef struct state_entry_st {
+  struct state_entry_st *next;
+  uint64_t hash;
+  uint32_t klen;
+  uint32_t vlen;
+  uint8_t  data[];       // key, padded to 8 bytes, then value
+} state_entry_st;
+
+typedef struct state_table_st {
+  size_t          mask;
+  size_t          count;
+  state_entry_st *buckets[];
+} state_table_st;
+
+struct swiss_state_st {
+  struct swiss_state_st *next;
+  pthread_mutex_t        write_lock;
+  state_table_st        *table;
+  char                   name[];
+};
+
+// one per thread, state is the epoch it entered in shifted left, plus 1 while inside
+typedef struct state_reader_st {
+  struct state_reader_st *next;
+  uint64_t                state;
+  uint32_t                in_use;
+  uint32_t                depth;
+} state_reader_st;
+
+enum {
+  STATE_GARBAGE_CHAIN = 0,
+  STATE_GARBAGE_TABLE
+};
+
+typedef struct state_garbage_st {
+  struct state_garbage_st *next;
+  void                    *ptr;
+  int                      kind;
+  uint64_t                 epoch;
+} state_garbage_st;
+
+typedef struct state_op_st {
+  struct state_op_st *next;
+  state_entry_st     *entry;
+  int                 remove;
+} state_op_st;
+
+struct swiss_state_bulk_st {
+  swiss_state_st *map;
+  int             replace;
+  size_t          puts;
+  state_op_st    *head;
+  state_op_st    *tail;
+};
+
+typedef struct state_file_hdr_st {
+  uint64_t magic;
+  uint64_t count;
+} state_file_hdr_st;
+
+
+#define STATE_INITIAL_BUCKETS 64
+#define STATE_FILE_MAGIC 0x3145544154535753ULL  // "SWSTATE1"
+#define STATE_PAD(len) (((len) + 7) & ~((size_t)7))
+#define STATE_VALUE(e) ((e)->data + STATE_PAD((e)->klen))
+
+
+static swiss_shared_st state_local = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, 0 };
+
+static __thread state_reader_st *state_self = NULL;
+static __thread swiss_shared_st *state_self_root = NULL;
+static pthread_key_t state_key;
+static pthread_once_t state_key_once = PTHREAD_ONCE_INIT;
+
+
+static swiss_shared_st *state_root()
+{
+  const swiss_core_ops_st *ops = swiss_core();
+
+  if ((ops) && (ops->shared)) {
+    return (ops->shared);
+  }
+
+  return (&state_local);
+}
+
+
+static uint64_t state_hash(const uint8_t *key, const size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= key[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return (hash);
+}
+
+
+/*
+ * Reader records
+ */
+
+static void state_thread_exit(void *reader)
+{
+  __atomic_store_n(&((state_reader_st *)reader)->state, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&((state_reader_st *)reader)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+static void state_make_key()
+{
+  pthread_key_create(&state_key, state_thread_exit);
+}
+
+
+// claims a record left by a thread that exited, or adds one
+static state_reader_st *state_reader()
+{
+  swiss_shared_st *root = state_root();
+  state_reader_st *reader;
+
+  if ((state_self) && (state_self_root == root)) {
+    return (state_self);
+  }
+
+  pthread_once(&state_key_once, state_make_key);
+  pthread_mutex_lock(&root->lock);
+
+  for (reader = (state_reader_st *)root->readers; reader; reader = reader->next) {
+    if (!__atomic_exchange_n(&reader->in_use, 1, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+
+  if ((!reader) && ((reader = (state_reader_st *)calloc(1, sizeof(state_reader_st))) != NULL)) {
+    reader->in_use = 1;
+    reader->next = (state_reader_st *)root->readers;
+    root->readers = reader;
+  }
+
+  pthread_mutex_unlock(&root->lock);
+
+  if (!reader) {
+    abort();
+  }
+
+  reader->depth = 0;
+  state_self = reader;
+  state_self_root = root;
+  pthread_setspecific(state_key, reader);
+
+  return (reader);
+}
+
+
+void swiss_state_enter()
+{
+  state_reader_st *self = state_reader();
+
+  if (self->depth++ == 0) {
+    __atomic_store_n(&self->state, (__atomic_load_n(&state_root()->epoch, __ATOMIC_RELAXED) << 1) | 1, 
+		     __ATOMIC_RELAXED);
+    // the store has to be visible before any map pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+
+void swiss_state_exit()
+{
+  state_reader_st *self = state_self;
+
+  if ((self) && (self->depth) && (--self->depth == 0)) {
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+  }
+}
+
+
+/*
+ * Reclamation, root->lock is held
+ */
+
+static void state_free_chain(state_entry_st *entry)
+{
+  state_entry_st *next;
+
+  while (entry) {
+    next = entry->next;
+    free(entry);
+    entry = next;
+  }
+}
+
+
+static void state_free_table(state_table_st *table)
+{
+  size_t i;
+
+  for (i = 0; i <= table->mask; ++i) {
+    state_free_chain(table->buckets[i]);
+  }
+  free(table);
+}
+
+
+// moves the epoch on once every reader inside has seen the current one
+static void state_advance(swiss_shared_st *root)
+{
+  state_reader_st *reader;
+  uint64_t epoch = root->epoch;
+  uint64_t state;
+
+  // pairs with the fence in swiss_state_enter, retired memory is unlinked by now
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for (reader = (state_reader_st *)root->readers; reader; reader = reader->next) {
+    state = __atomic_load_n(&reader->state, __ATOMIC_ACQUIRE);
+    if ((state & 1) && ((state >> 1) != epoch)) {
+      return;
+    }
+  }
+
+  __atomic_store_n(&root->epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+
+static void state_collect(swiss_shared_st *root)
+{
+  state_garbage_st **prev = (state_garbage_st **)&root->garbage;
+  state_garbage_st *garbage;
+
+  state_advance(root);
+
+  // nothing retired two epochs back can still be referenced
+  while ((garbage = *prev) != NULL) {
+    if (garbage->epoch + 2 > root->epoch) {
+      prev = &garbage->next;
+      continue;
+    }
+
+    *prev = garbage->next;
+    if (garbage->kind == STATE_GARBAGE_TABLE) {
+      state_free_table((state_table_st *)garbage->ptr);
+    } else {
+      state_free_chain((state_entry_st *)garbage->ptr);
+    }
+    free(garbage);
+  }
+}
+
+
+// ptr is already unreachable for new readers
+static void state_retire(void *ptr, const int kind)
+{
+  swiss_shared_st *root = state_root();
+  state_garbage_st *garbage;
+
+  pthread_mutex_lock(&root->lock);
+
+  if ((ptr) && ((garbage = (state_garbage_st *)malloc(sizeof(state_garbage_st))) != NULL)) {
+    garbage->ptr = ptr;
+    garbage->kind = kind;
+    garbage->epoch = root->epoch;
+    garbage->next = (state_garbage_st *)root->garbage;
+    root->garbage = garbage;
+  }
+  // todo: log error, on malloc failure ptr is leaked rather than freed early
+
+  state_collect(root);
+
+  pthread_mutex_unlock(&root->lock);
+}
+
+
+/*
+ * Tables and entries
+ */
+
+static state_entry_st *state_entry_new(const uint64_t hash, const void *key, const size_t klen, 
+				       const void *value, const size_t vlen)
+{
+  state_entry_st *entry;
+
+  if ((klen > UINT32_MAX) || (vlen > UINT32_MAX)) {
+    return (NULL);
+  }
+
+  if ((entry = (state_entry_st *)malloc(sizeof(state_entry_st) + STATE_PAD(klen) + vlen)) == NULL) {
+    return (NULL);
+  }
+
+  entry->next = NULL;
+  entry->hash = hash;
+  entry->klen = klen;
+  entry->vlen = vlen;
+  memcpy(entry->data, key, klen);
+  if (vlen) {
+    memcpy(STATE_VALUE(entry), value, vlen);
+  }
+
+  return (entry);
+}
+
+
+static state_entry_st *state_entry_copy(const state_entry_st *entry)
+{
+  size_t size = sizeof(state_entry_st) + STATE_PAD(entry->klen) + entry->vlen;
+  state_entry_st *copy;
+
+  if ((copy = (state_entry_st *)malloc(size)) != NULL) {
+    memcpy(copy, entry, size);
+    copy->next = NULL;
+  }
+
+  return (copy);
+}
+
+
+static int state_entry_match(const state_entry_st *entry, const uint64_t hash, 
+			     const void *key, const size_t klen)
+{
+  return ((entry->hash == hash) && (entry->klen == klen) && (!memcmp(entry->data, key, klen)));
+}
+
+
+static state_table_st *state_table_new(const size_t count)
+{
+  state_table_st *table;
+  size_t buckets = STATE_INITIAL_BUCKETS;
+
+  while (buckets < count) {
+    buckets <<= 1;
+  }
+
+  if ((table = (state_table_st *)calloc(1, sizeof(state_table_st) + 
+					buckets * sizeof(state_entry_st *))) != NULL) {
+    table->mask = buckets - 1;
+  }
+
+  return (table);
+}
+
+
+// table is private to the caller, an entry with the same key is freed
+static void state_table_insert(state_table_st *table, state_entry_st *entry)
+{
+  state_entry_st **prev = &table->buckets[entry->hash & table->mask];
+
+  for (; *prev; prev = &(*prev)->next) {
+    if (state_entry_match(*prev, entry->hash, entry->data, entry->klen)) {
+      state_entry_st *old = *prev;
+
+      entry->next = old->next;
+      *prev = entry;
+      free(old);
+      return;
+    }
+  }
+
+  entry->next = table->buckets[entry->hash & table->mask];
+  table->buckets[entry->hash & table->mask] = entry;
+  ++table->count;
+}
+
+
+static void state_table_remove(state_table_st *table, const uint64_t hash, 
+			       const void *key, const size_t klen)
+{
+  state_entry_st **prev = &table->buckets[hash & table->mask];
+
+  for (; *prev; prev = &(*prev)->next) {
+    if (state_entry_match(*prev, hash, key, klen)) {
+      state_entry_st *old = *prev;
+
+      *prev = old->next;
+      free(old);
+      --table->count;
+      return;
+    }
+  }
+}
+
+
+// a private copy of table with room for count entries
+static state_table_st *state_table_copy(const state_table_st *table, const size_t count)
+{
+  state_table_st *copy;
+  state_entry_st *entry;
+  state_entry_st *dup;
+  size_t i;
+
+  if ((copy = state_table_new(count)) == NULL) {
+    return (NULL);
+  }
+
+  for (i = 0; (table) && (i <= table->mask); ++i) {
+    for (entry = table->buckets[i]; entry; entry = entry->next) {
+      if ((dup = state_entry_copy(entry)) == NULL) {
+	state_free_table(copy);
+	return (NULL);
+      }
+      state_table_insert(copy, dup);
+    }
+  }
+
+  return (copy);
+}
+
+
+static void state_publish_table(swiss_state_st *map, state_table_st *table)
+{
+  state_table_st *old = map->table;
+
+  __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+  state_retire(old, STATE_GARBAGE_TABLE);
+}
+
+
+/*
+ * Maps
+ */
+
+swiss_state_st *swiss_state_open(const char *name)
+{
+  swiss_shared_st *root = state_root();
+  swiss_state_st *map;
+
+  if (!name) {
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&root->lock);
+
+  for (map = (swiss_state_st *)root->maps; map; map = map->next) {
+    if (!strcmp(map->name, name)) {
+      break;
+    }
+  }
+
+  if ((!map) && ((map = (swiss_state_st *)malloc(sizeof(swiss_state_st) + strlen(name) + 1)) != NULL)) {
+    if ((map->table = state_table_new(0)) == NULL) {
+      free(map);
+      map = NULL;
+    } else {
+      pthread_mutex_init(&map->write_lock, NULL);
+      strcpy(map->name, name);
+      map->next = (swiss_state_st *)root->maps;
+      root->maps = map;
+    }
+  }
+
+  pthread_mutex_unlock(&root->lock);
+
+  return (map);
+}
+
+
+const void *swiss_state_lookup(swiss_state_st *map, const void *key, const size_t klen, 
+			       size_t *vlen)
+{
+  uint64_t hash;
+  state_table_st *table;
+  state_entry_st *entry;
+
+  if ((!map) || (!key)) {
+    return (NULL);
+  }
+
+  hash = state_hash((const uint8_t *)key, klen);
+  table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+
+  for (entry = __atomic_load_n(&table->buckets[hash & table->mask], __ATOMIC_ACQUIRE); entry; 
+       entry = entry->next) {
+    if (state_entry_match(entry, hash, key, klen)) {
+      if (vlen) {
+	*vlen = entry->vlen;
+      }
+      return (STATE_VALUE(entry));
+    }
+  }
+
+  return (NULL);
+}
+
+
+int64_t swiss_state_get(swiss_state_st *map, const void *key, const size_t klen, 
+			void *value, const size_t len)
+{
+  const void *found;
+  size_t vlen;
+  int64_t ret = -1;
+
+  swiss_state_enter();
+
+  if ((found = swiss_state_lookup(map, key, klen, &vlen)) != NULL) {
+    if (value) {
+      memcpy(value, found, (vlen < len) ? vlen : len);
+    }
+    ret = vlen;
+  }
+
+  swiss_state_exit();
+
+  return (ret);
+}
+
+
+/*
+ * replaces one bucket's chain with a copy that has key put or removed,
+ * growing the table once chains get long. the write lock is held.
+ */
+static int state_update(swiss_state_st *map, const uint64_t hash, const void *key, const size_t klen, 
+			state_entry_st *entry)
+{
+  state_table_st *table = map->table;
+  state_entry_st **bucket = &table->buckets[hash & table->mask];
+  state_entry_st *old = *bucket;
+  state_entry_st *chain = NULL;
+  state_entry_st *cur;
+  state_entry_st *dup;
+  int found = 0;
+
+  for (cur = old; cur; cur = cur->next) {
+    if (state_entry_match(cur, hash, key, klen)) {
+      found = 1;
+      continue;
+    }
+    if ((dup = state_entry_copy(cur)) == NULL) {
+      state_free_chain(chain);
+      return (-1);
+    }
+    dup->next = chain;
+    chain = dup;
+  }
+
+  if ((!entry) && (!found)) {
+    state_free_chain(chain);
+    return (0);
+  }
+
+  if (entry) {
+    entry->next = chain;
+    chain = entry;
+  }
+
+  __atomic_store_n(bucket, chain, __ATOMIC_RELEASE);
+  table->count += (entry ? 1 : 0) - found;
+  state_retire(old, STATE_GARBAGE_CHAIN);
+
+  if (table->count > (table->mask + 1) * 2) {
+    if ((table = state_table_copy(map->table, table->count)) != NULL) {
+      state_publish_table(map, table);
+    }
+  }
+
+  return (0);
+}
+
+
+int swiss_state_put(swiss_state_st *map, const void *key, const size_t klen, 
+		    const void *value, const size_t vlen)
+{
+  state_entry_st *entry;
+  uint64_t hash;
+  int ret;
+
+  if ((!map) || (!key) || ((!value) && (vlen))) {
+    return (-1);
+  }
+
+  hash = state_hash((const uint8_t *)key, klen);
+  if ((entry = state_entry_new(hash, key, klen, value, vlen)) == NULL) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&map->write_lock);
+  if ((ret = state_update(map, hash, key, klen, entry)) < 0) {
+    free(entry);
+  }
+  pthread_mutex_unlock(&map->write_lock);
+
+  return (ret);
+}
+
+
+int swiss_state_remove(swiss_state_st *map, const void *key, const size_t klen)
+{
+  int ret;
+
+  if ((!map) || (!key)) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&map->write_lock);
+  ret = state_update(map, state_hash((const uint8_t *)key, klen), key, klen, NULL);
+  pthread_mutex_unlock(&map->write_lock);
+
+  return (ret);
+}
+
+
+size_t swiss_state_count(swiss_state_st *map)
+{
+  size_t count;
+
+  if (!map) {
+    return (0);
+  }
+
+  swiss_state_enter();
+  count = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE)->count;
+  swiss_state_exit();
+
+  return (count);
+}
+
+
+/*
+ * Bulk updates
+ */
+
+swiss_state_bulk_st *swiss_state_bulk_begin(swiss_state_st *map, const int replace)
+{
+  swiss_state_bulk_st *bulk;
+
+  if ((!map) || ((bulk = (swiss_state_bulk_st *)calloc(1, sizeof(swiss_state_bulk_st))) == NULL)) {
+    return (NULL);
+  }
+
+  bulk->map = map;
+  bulk->replace = replace;
+
+  return (bulk);
+}
+
+
+static int state_bulk_add(swiss_state_bulk_st *bulk, state_entry_st *entry, const int remove)
+{
+  state_op_st *op;
+
+  if ((op = (state_op_st *)malloc(sizeof(state_op_st))) == NULL) {
+    free(entry);
+    return (-1);
+  }
+
+  op->next = NULL;
+  op->entry = entry;
+  op->remove = remove;
+
+  if (bulk->tail) {
+    bulk->tail->next = op;
+  } else {
+    bulk->head = op;
+  }
+  bulk->tail = op;
+  bulk->puts += remove ? 0 : 1;
+
+  return (0);
+}
+
+
+int swiss_state_bulk_put(swiss_state_bulk_st *bulk, const void *key, const size_t klen, 
+			 const void *value, const size_t vlen)
+{
+  state_entry_st *entry;
+
+  if ((!bulk) || (!key) || ((!value) && (vlen))) {
+    return (-1);
+  }
+
+  if ((entry = state_entry_new(state_hash((const uint8_t *)key, klen), key, klen, value, vlen)) == NULL) {
+    return (-1);
+  }
+
+  return (state_bulk_add(bulk, entry, 0));
+}
+
+
+int swiss_state_bulk_remove(swiss_state_bulk_st *bulk, const void *key, const size_t klen)
+{
+  state_entry_st *entry;
+
+  if ((!bulk) || (!key)) {
+    return (-1);
+  }
+
+  // only the key is kept
+  if ((entry = state_entry_new(state_hash((const uint8_t *)key, klen), key, klen, NULL, 0)) == NULL) {
+    return (-1);
+  }
+
+  return (state_bulk_add(bulk, entry, 1));
+}
+
+
+void swiss_state_bulk_abort(swiss_state_bulk_st *bulk)
+{
+  state_op_st *op;
+
+  if (!bulk) {
+    return;
+  }
+
+  while ((op = bulk->head) != NULL) {
+    bulk->head = op->next;
+    free(op->entry);
+    free(op);
+  }
+
+  free(bulk);
+}
+
+
+int swiss_state_bulk_commit(swiss_state_bulk_st *bulk)
+{
+  swiss_state_st *map;
+  state_table_st *table;
+  state_op_st *op;
+
+  if (!bulk) {
+    return (-1);
+  }
+
+  map = bulk->map;
+  pthread_mutex_lock(&map->write_lock);
+
+  if ((table = state_table_copy(bulk->replace ? NULL : map->table, 
+				(bulk->replace ? 0 : map->table->count) + bulk->puts)) == NULL) {
+    pthread_mutex_unlock(&map->write_lock);
+    swiss_state_bulk_abort(bulk);
+    return (-1);
+  }
+
+  // the new table isn't visible yet, so apply in place
+  while ((op = bulk->head) != NULL) {
+    bulk->head = op->next;
+    if (op->remove) {
+      state_table_remove(table, op->entry->hash, op->entry->data, op->entry->klen);
+      free(op->entry);
+    } else {
+      state_table_insert(table, op->entry);
+    }
+    free(op);
+  }
+
+  state_publish_table(map, table);
+
+  pthread_mutex_unlock(&map->write_lock);
+  free(bulk);
+
+  return (0);
+}
+
+
+/*
+ * Snapshots
+ */
+
+int64_t swiss_state_save(swiss_state_st *map, const char *path)
+{
+  char tmp[4096];
+  state_table_st *table;
+  state_entry_st *entry;
+  state_file_hdr_st *hdr;
+  uint8_t *base;
+  uint8_t *cur;
+  size_t size = sizeof(state_file_hdr_st);
+  uint64_t count = 0;
+  size_t i;
+  int fd;
+
+  if ((!map) || (!path) || (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))) {
+    return (-1);
+  }
+
+  // writers wait, so the table can't change between sizing and copying it
+  pthread_mutex_lock(&map->write_lock);
+  table = map->table;
+
+  for (i = 0; i <= table->mask; ++i) {
+    for (entry = table->buckets[i]; entry; entry = entry->next) {
+      size += 2 * sizeof(uint32_t) + STATE_PAD(entry->klen) + STATE_PAD(entry->vlen);
+      ++count;
+    }
+  }
+
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    pthread_mutex_unlock(&map->write_lock);
+    return (-1);
+  }
+
+  if ((ftruncate(fd, size) < 0) || 
+      ((base = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    pthread_mutex_unlock(&map->write_lock);
+    close(fd);
+    unlink(tmp);
+    return (-1);
+  }
+
+  hdr = (state_file_hdr_st *)base;
+  hdr->magic = STATE_FILE_MAGIC;
+  hdr->count = count;
+  cur = base + sizeof(state_file_hdr_st);
+
+  for (i = 0; i <= table->mask; ++i) {
+    for (entry = table->buckets[i]; entry; entry = entry->next) {
+      ((uint32_t *)cur)[0] = entry->klen;
+      ((uint32_t *)cur)[1] = entry->vlen;
+      cur += 2 * sizeof(uint32_t);
+      memcpy(cur, entry->data, entry->klen);
+      cur += STATE_PAD(entry->klen);
+      memcpy(cur, STATE_VALUE(entry), entry->vlen);
+      cur += STATE_PAD(entry->vlen);
+    }
+  }
+
+  pthread_mutex_unlock(&map->write_lock);
+
+  if ((msync(base, size, MS_SYNC) < 0) || (rename(tmp, path) < 0)) {
+    munmap(base, size);
+    close(fd);
+    unlink(tmp);
+    return (-1);
+  }
+
+  munmap(base, size);
+  close(fd);
+
+  return (count);
+}
+
+
+int64_t swiss_state_load(swiss_state_st *map, const char *path)
+{
+  swiss_state_bulk_st *bulk;
+  state_file_hdr_st *hdr;
+  struct stat st;
+  uint8_t *base;
+  uint8_t *cur;
+  uint8_t *end;
+  uint64_t count;
+  uint64_t i;
+  int fd;
+
+  if ((!map) || (!path) || ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)) {
+    return (-1);
+  }
+
+  if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(state_file_hdr_st)) ||
+      ((base = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+    close(fd);
+    return (-1);
+  }
+  close(fd);
+
+  hdr = (state_file_hdr_st *)base;
+  cur = base + sizeof(state_file_hdr_st);
+  end = base + st.st_size;
+  count = hdr->count;
+
+  if ((hdr->magic != STATE_FILE_MAGIC) || ((bulk = swiss_state_bulk_begin(map, 1)) == NULL)) {
+    munmap(base, st.st_size);
+    return (-1);
+  }
+
+  for (i = 0; i < count; ++i) {
+    uint32_t klen;
+    uint32_t vlen;
+
+    if ((size_t)(end - cur) < 2 * sizeof(uint32_t)) {
+      break;
+    }
+    klen = ((uint32_t *)cur)[0];
+    vlen = ((uint32_t *)cur)[1];
+    cur += 2 * sizeof(uint32_t);
+
+    if ((size_t)(end - cur) < STATE_PAD(klen) + STATE_PAD(vlen)) {
+      break;
+    }
+
+    if (swiss_state_bulk_put(bulk, cur, klen, cur + STATE_PAD(klen), vlen) < 0) {
+      break;
+    }
+    cur += STATE_PAD(klen) + STATE_PAD(vlen);
+  }
+
+  munmap(base, st.st_size);
+
+  // a truncated or corrupt snapshot leaves the map as it was
+  if (i != count) {
+    swiss_state_bulk_abort(bulk);
+    return (-1);
+  }
+
+  return ((swiss_state_bulk_commit(bulk) < 0) ? -1 : (int64_t)i);
+}
@@ -0,0 +1,114 @@
+/*
+ * state_lib.h
+ *
+ *
+ * Swiss Module Shared State Store
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_STATE_LIB__
+#define __SWISS_STATE_LIB__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/*
+ * Named hash maps shared by every module in the process (each worker
+ * has its own in prefork mode). Readers never lock: a lookup runs
+ * between swiss_state_enter and swiss_state_exit, and memory a writer
+ * replaces is only freed once every reader that could still see it
+ * has left (epoch based reclamation). Writers are serialized per map
+ * and copy the bucket they change; bulk updates build a whole new
+ * table and publish it at once. Without a core the maps are private
+ * to the module.
+ */
+typedef struct swiss_state_st swiss_state_st;
+typedef struct swiss_state_bulk_st swiss_state_bulk_st;
+
+/* finds or creates the map called name */
+swiss_state_st *swiss_state_open(const char *name);
+
+/* reader critical section, may nest but must not block for long */
+void swiss_state_enter();
+void swiss_state_exit();
+
+/* value stays valid until swiss_state_exit, NULL if key is missing */
+const void *swiss_state_lookup(swiss_state_st *map, const void *key, const size_t klen, 
+			       size_t *vlen);
+/* copies up to len bytes of the value, returns its full length or -1 */
+int64_t swiss_state_get(swiss_state_st *map, const void *key, const size_t klen, 
+			void *value, const size_t len);
+
+int swiss_state_put(swiss_state_st *map, const void *key, const size_t klen, 
+		    const void *value, const size_t vlen);
+int swiss_state_remove(swiss_state_st *map, const void *key, const size_t klen);
+size_t swiss_state_count(swiss_state_st *map);
+
+/*
+ * Staged changes that readers see all at once on commit. With replace
+ * set the map is emptied first, i.e. for reloading a routing table.
+ * commit and abort free the bulk.
+ */
+swiss_state_bulk_st *swiss_state_bulk_begin(swiss_state_st *map, const int replace);
+int swiss_state_bulk_put(swiss_state_bulk_st *bulk, const void *key, const size_t klen, 
+			 const void *value, const size_t vlen);
+int swiss_state_bulk_remove(swiss_state_bulk_st *bulk, const void *key, const size_t klen);
+int swiss_state_bulk_commit(swiss_state_bulk_st *bulk);
+void swiss_state_bulk_abort(swiss_state_bulk_st *bulk);
+
+/*
+ * Snapshot a map to path (written to a temporary file through mmap and
+ * renamed into place) and load one back, replacing the map's contents.
+ * Both return the number of entries or -1.
+ */
+int64_t swiss_state_save(swiss_state_st *map, const char *path);
+int64_t swiss_state_load(swiss_state_st *map, const char *path);
+
+#ifdef __cplusplus 
+}
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * task_lib.c
+ *
+ *
+ * Swiss Module Task Groups
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#include "module_lib.h"
+#include "task_lib.h"
+
+
+// chunks per thread when the caller leaves the grain to us
+#define TASK_AUTO_CHUNKS 4
+
+
+struct swiss_task_group_st {
+  void *core;
+};
+
+typedef struct task_chunk_st {
+  size_t  begin;
+  size_t  end;
+  void   *ctx;
+  void  (*fp)(void *ctx, const size_t begin, const size_t end);
+  void  (*map)(void *ctx, const size_t begin, const size_t end, void *partial);
+  void   *partial;
+} task_chunk_st;
+
+
+swiss_task_group_st *swiss_task_group_create()
+{
+  const swiss_core_ops_st *ops = swiss_core();
+  swiss_task_group_st *group;
+
+  if ((group = (swiss_task_group_st *)malloc(sizeof(swiss_task_group_st))) == NULL) {
+    return (NULL);
+  }
+
+  // the pool is only there once the module's server has started
+  group->core = NULL;
+  if ((ops) && (ops->pool)) {
+    group->core = ops->group_create(ops->pool);
+  }
+
+  return (group);
+}
+
+
+int swiss_task_group_run_bulk(swiss_task_group_st *group, void (*fp)(void *), 
+			      void **opaques, const size_t count)
+{
+  size_t i;
+
+  if ((!group) || (!fp) || ((!opaques) && (count))) {
+    return (-1);
+  }
+
+  if (group->core) {
+    swiss_core()->group_run(group->core, fp, opaques, count);
+  } else {
+    for (i = 0; i < count; ++i) {
+      fp(opaques[i]);
+    }
+  }
+
+  return (0);
+}
+
+
+int swiss_task_group_run(swiss_task_group_st *group, void (*fp)(void *), void *opaque)
+{
+  return (swiss_task_group_run_bulk(group, fp, &opaque, 1));
+}
+
+
+void swiss_task_group_wait(swiss_task_group_st *group)
+{
+  if ((group) && (group->core)) {
+    swiss_core()->group_wait(group->core);
+  }
+}
+
+
+void swiss_task_group_destroy(swiss_task_group_st *group)
+{
+  if (!group) {
+    return;
+  }
+
+  if (group->core) {
+    swiss_core()->group_destroy(group->core);
+  }
+
+  free(group);
+}
+
+
+static size_t task_grain(const size_t count, const size_t grain)
+{
+  const swiss_core_ops_st *ops = swiss_core();
+  size_t chunks;
+
+  if (grain) {
+    return (grain);
+  }
+
+  chunks = (ops ? ops->threads + 1 : 1) * TASK_AUTO_CHUNKS;
+
+  return ((count + chunks - 1) / chunks);
+}
+
+
+static void task_for_entry(void *opaque)
+{
+  task_chunk_st *chunk = (task_chunk_st *)opaque;
+
+  chunk->fp(chunk->ctx, chunk->begin, chunk->end);
+}
+
+
+static void task_map_entry(void *opaque)
+{
+  task_chunk_st *chunk = (task_chunk_st *)opaque;
+
+  chunk->map(chunk->ctx, chunk->begin, chunk->end, chunk->partial);
+}
+
+
+/*
+ * splits [begin, end) into chunks and runs entry over them in a group.
+ * partials, if given, holds one result_size slot per chunk.
+ */
+static int task_split(const size_t begin, const size_t end, const size_t grain, 
+		      void (*entry)(void *), task_chunk_st *proto, 
+		      uint8_t **partials, const void *identity, const size_t result_size,
+		      size_t *chunk_count)
+{
+  swiss_task_group_st *group;
+  task_chunk_st       *chunks;
+  void               **opaques;
+  size_t               step = task_grain(end - begin, grain);
+  size_t               count;
+  size_t               i;
+
+  // a grain past the range would overflow the chunk arithmetic below
+  if (step > end - begin) {
+    step = end - begin;
+  }
+  count = (end - begin + step - 1) / step;
+
+  chunks = (task_chunk_st *)malloc(count * sizeof(task_chunk_st));
+  opaques = (void **)malloc(count * sizeof(void *));
+  if (partials) {
+    *partials = (uint8_t *)malloc(count * result_size);
+  }
+
+  if ((!chunks) || (!opaques) || ((partials) && (!*partials)) || 
+      ((group = swiss_task_group_create()) == NULL)) {
+    free(chunks);
+    free(opaques);
+    if (partials) {
+      free(*partials);
+    }
+    return (-1);
+  }
+
+  for (i = 0; i < count; ++i) {
+    chunks[i] = *proto;
+    chunks[i].begin = begin + i * step;
+    chunks[i].end = (chunks[i].begin + step < end) ? chunks[i].begin + step : end;
+    if (partials) {
+      chunks[i].partial = *partials + i * result_size;
+      memcpy(chunks[i].partial, identity, result_size);
+    }
+    opaques[i] = &chunks[i];
+  }
+
+  swiss_task_group_run_bulk(group, entry, opaques, count);
+  swiss_task_group_destroy(group);
+
+  free(chunks);
+  free(opaques);
+  *chunk_count = count;
+
+  return (0);
+}
+
+
+int swiss_parallel_for(const size_t begin, const size_t end, const size_t grain, 
+		       void (*fp)(void *ctx, const size_t begin, const size_t end), void *ctx)
+{
+  task_chunk_st proto;
+  size_t        count;
+
+  if (!fp) {
+    return (-1);
+  }
+
+  if (begin >= end) {
+    return (0);
+  }
+
+  memset(&proto, 0, sizeof(proto));
+  proto.fp = fp;
+  proto.ctx = ctx;
+
+  return (task_split(begin, end, grain, &task_for_entry, &proto, NULL, NULL, 0, &count));
+}
+
+
+int swiss_parallel_reduce(const size_t begin, const size_t end, const size_t grain, 
+			  void (*map)(void *ctx, const size_t begin, const size_t end, void *partial),
+			  void (*combine)(void *ctx, void *result, const void *partial),
+			  void *ctx, void *result, const size_t result_size)
+{
+  task_chunk_st proto;
+  uint8_t      *partials;
+  size_t        count;
+  size_t        i;
+
+  if ((!map) || (!combine) || (!result) || (!result_size)) {
+    return (-1);
+  }
+
+  if (begin >= end) {
+    return (0);
+  }
+
+  memset(&proto, 0, sizeof(proto));
+  proto.map = map;
+  proto.ctx = ctx;
+
+  if (task_split(begin, end, grain, &task_map_entry, &proto, &partials, result, 
+		 result_size, &count) < 0) {
+    return (-1);
+  }
+
+  for (i = 0; i < count; ++i) {
+    combine(ctx, result, partials + i * result_size);
+  }
+
+  free(partials);
+
+  return (0);
+}
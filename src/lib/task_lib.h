@@ -0,0 +1,98 @@
+/*
+ * task_lib.h
+ *
+ *
+ * Swiss Module Task Groups
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_TASK_LIB__
+#define __SWISS_TASK_LIB__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/*
+ * Fan work for a single request out over the module's server threads.
+ * Waiting on a group runs its queued tasks on the calling thread, so a
+ * worker never sits idle on its own subtasks. Without a core (e.g. a
+ * module driven by a test harness) tasks simply run inline.
+ */
+typedef struct swiss_task_group_st swiss_task_group_st;
+
+swiss_task_group_st *swiss_task_group_create();
+int swiss_task_group_run(swiss_task_group_st *group, void (*fp)(void *), void *opaque);
+int swiss_task_group_run_bulk(swiss_task_group_st *group, void (*fp)(void *), 
+			      void **opaques, const size_t count);
+void swiss_task_group_wait(swiss_task_group_st *group);
+/* waits for any outstanding tasks before freeing the group */
+void swiss_task_group_destroy(swiss_task_group_st *group);
+
+
+/*
+ * calls fp over [begin, end) in chunks of grain items, grain 0 picks a
+ * chunk size from the number of server threads
+ */
+int swiss_parallel_for(const size_t begin, const size_t end, const size_t grain, 
+		       void (*fp)(void *ctx, const size_t begin, const size_t end), void *ctx);
+
+/*
+ * every chunk maps into its own copy of *result (which holds the
+ * identity on entry), the partials are then combined into *result in
+ * chunk order so the outcome does not depend on scheduling
+ */
+int swiss_parallel_reduce(const size_t begin, const size_t end, const size_t grain, 
+			  void (*map)(void *ctx, const size_t begin, const size_t end, void *partial),
+			  void (*combine)(void *ctx, void *result, const void *partial),
+			  void *ctx, void *result, const size_t result_size);
+
+
+#ifdef __cplusplus 
+}
+#endif
+
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * cache_test.c
+ *
+ *
+ * Swiss Module Response Cache Test
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+/*
+ * exercises cache_lib: get, put and remove, ttl expiry, the order the
+ * clock hand evicts in, and the clamp on the shard count
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../cache_lib.h"
+
+
+static int failed = 0;
+
+#define CHECK(cond, what) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "FAIL: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+      ++failed;								\
+    }									\
+  } while (0)
+
+
+#define KEY(k) ((const uint8_t *)(k)), strlen(k)
+
+
+// the cache holds a reference while the entry is in it, unlike a get this leaves the clock alone
+static int cached(const swiss_buf_st *buf)
+{
+  return (buf->refs > 1);
+}
+
+
+static void test_basic()
+{
+  swiss_cache_stats_st stats;
+  swiss_cache_st      *cache;
+  swiss_buf_st        *one = swiss_buf_copy((const uint8_t *)"one", 3);
+  swiss_buf_st        *two = swiss_buf_copy((const uint8_t *)"two", 3);
+  swiss_buf_st        *buf;
+
+  CHECK((cache = swiss_cache_create(4, 1 << 20)) != NULL, "cache created");
+
+  CHECK(swiss_cache_get(cache, KEY("a")) == NULL, "miss on an empty cache");
+  CHECK(swiss_cache_put(cache, KEY("a"), one, 0) == 0, "put");
+  CHECK(((buf = swiss_cache_get(cache, KEY("a"))) == one) && (!memcmp(buf->data, "one", 3)), 
+	"get returns what was put");
+  swiss_buf_release(buf);
+
+  CHECK(swiss_cache_put(cache, KEY("a"), two, 0) == 0, "put over an existing key");
+  CHECK((buf = swiss_cache_get(cache, KEY("a"))) == two, "get returns the replacement");
+  swiss_buf_release(buf);
+  CHECK(!cached(one), "replaced buffer is released");
+
+  CHECK(swiss_cache_remove(cache, KEY("a")) == 0, "remove");
+  CHECK(swiss_cache_remove(cache, KEY("a")) == -1, "remove of a missing key");
+  CHECK(swiss_cache_get(cache, KEY("a")) == NULL, "miss after remove");
+
+  swiss_cache_stats(cache, &stats);
+  CHECK((stats.hits == 2) && (stats.misses == 2) && (stats.inserts == 2) && (!stats.entries) && 
+	(!stats.bytes), "stats add up");
+
+  swiss_cache_destroy(cache);
+  swiss_buf_release(one);
+  swiss_buf_release(two);
+}
+
+
+static void test_ttl()
+{
+  swiss_cache_stats_st stats;
+  swiss_cache_st      *cache;
+  swiss_buf_st        *buf = swiss_buf_copy((const uint8_t *)"ttl", 3);
+  swiss_buf_st        *got;
+
+  CHECK((cache = swiss_cache_create(1, 1 << 20)) != NULL, "cache created");
+  CHECK(swiss_cache_put(cache, KEY("short"), buf, 50) == 0, "put with a ttl");
+  CHECK(swiss_cache_put(cache, KEY("forever"), buf, 0) == 0, "put without a ttl");
+
+  got = swiss_cache_get(cache, KEY("short"));
+  CHECK(got == buf, "hit before the ttl runs out");
+  swiss_buf_release(got);
+
+  usleep(80 * 1000);
+
+  CHECK(swiss_cache_get(cache, KEY("short")) == NULL, "miss once the ttl has run out");
+  got = swiss_cache_get(cache, KEY("forever"));
+  CHECK(got == buf, "an entry without a ttl stays");
+  swiss_buf_release(got);
+
+  swiss_cache_stats(cache, &stats);
+  CHECK((stats.expirations == 1) && (stats.entries == 1), "expiry is counted and the entry dropped");
+
+  swiss_cache_destroy(cache);
+  swiss_buf_release(buf);
+}
+
+
+/*
+ * one shard sized for three entries. new entries go behind the hand,
+ * so the hand reaches them last and a referenced entry gets one more
+ * sweep before it is evicted.
+ */
+static void test_eviction()
+{
+  swiss_cache_stats_st stats;
+  swiss_cache_st      *cache;
+  swiss_buf_st        *bufs[6];
+  const char          *keys[6] = { "A", "B", "C", "D", "E", "F" };
+  swiss_buf_st        *got;
+  size_t               charge;
+  int                  i;
+
+  for (i = 0; i < 6; ++i) {
+    bufs[i] = swiss_buf_alloc(100);
+    memset(bufs[i]->data, 'a' + i, 100);
+  }
+
+  // what one entry costs, for sizing the budget
+  cache = swiss_cache_create(1, 1 << 20);
+  swiss_cache_put(cache, KEY(keys[0]), bufs[0], 0);
+  swiss_cache_stats(cache, &stats);
+  charge = stats.bytes;
+  swiss_cache_destroy(cache);
+
+  CHECK((cache = swiss_cache_create(1, charge * 3)) != NULL, "cache created");
+  for (i = 0; i < 3; ++i) {
+    swiss_cache_put(cache, KEY(keys[i]), bufs[i], 0);
+  }
+  CHECK(cached(bufs[0]) && cached(bufs[1]) && cached(bufs[2]), "three entries fit");
+
+  // A gets its second chance, B is the oldest unreferenced entry
+  got = swiss_cache_get(cache, KEY("A"));
+  swiss_buf_release(got);
+  swiss_cache_put(cache, KEY("D"), bufs[3], 0);
+  CHECK(cached(bufs[0]) && (!cached(bufs[1])) && cached(bufs[2]) && cached(bufs[3]), 
+	"D evicts B, not the referenced A");
+
+  // D went in behind the hand, so C is next and then A, whose reference was spent
+  swiss_cache_put(cache, KEY("E"), bufs[4], 0);
+  CHECK(cached(bufs[0]) && (!cached(bufs[2])) && cached(bufs[3]) && cached(bufs[4]), 
+	"E evicts C");
+  swiss_cache_put(cache, KEY("F"), bufs[5], 0);
+  CHECK((!cached(bufs[0])) && cached(bufs[3]) && cached(bufs[4]) && cached(bufs[5]), 
+	"F evicts A before the newer D");
+
+  swiss_cache_stats(cache, &stats);
+  CHECK((stats.evictions == 3) && (stats.entries == 3) && (stats.bytes <= charge * 3), 
+	"evictions counted and the budget kept");
+
+  swiss_cache_destroy(cache);
+  for (i = 0; i < 6; ++i) {
+    CHECK(!cached(bufs[i]), "destroy releases every entry");
+    swiss_buf_release(bufs[i]);
+  }
+}
+
+
+/*
+ * the shard count is rounded up to a power of 2 and capped at 65536, so
+ * each shard gets budget / 65536 and an entry costing more is refused
+ */
+static void test_shards()
+{
+  swiss_cache_stats_st stats;
+  swiss_cache_st      *cache;
+  swiss_buf_st        *buf = swiss_buf_alloc(100);
+  swiss_buf_st        *got;
+  size_t               charge;
+
+  cache = swiss_cache_create(1, 1 << 20);
+  swiss_cache_put(cache, KEY("k"), buf, 0);
+  swiss_cache_stats(cache, &stats);
+  charge = stats.bytes;
+  swiss_cache_destroy(cache);
+
+  CHECK((cache = swiss_cache_create(UINT32_MAX, charge * 65536)) != NULL, 
+	"a huge shard count is clamped, not overflowed");
+  CHECK(swiss_cache_put(cache, KEY("k"), buf, 0) == 0, "an entry fits a clamped shard");
+  CHECK(((got = swiss_cache_get(cache, KEY("k"))) == buf), "and can be read back");
+  swiss_buf_release(got);
+  swiss_cache_destroy(cache);
+
+  CHECK((cache = swiss_cache_create(UINT32_MAX, charge * 65536 - 65536)) != NULL, 
+	"cache created");
+  CHECK(swiss_cache_put(cache, KEY("k"), buf, 0) == -1, "shard budgets are split 65536 ways");
+  swiss_cache_destroy(cache);
+
+  // 3 rounds up to 4
+  CHECK((cache = swiss_cache_create(3, charge * 4)) != NULL, "cache created");
+  CHECK(swiss_cache_put(cache, KEY("k"), buf, 0) == 0, "an entry fits a quarter of the budget");
+  swiss_cache_destroy(cache);
+  CHECK((cache = swiss_cache_create(3, charge * 4 - 4)) != NULL, "cache created");
+  CHECK(swiss_cache_put(cache, KEY("k"), buf, 0) == -1, "3 shards round up to 4");
+  swiss_cache_destroy(cache);
+
+  CHECK(swiss_cache_create(4, 0) == NULL, "a cache needs a budget");
+
+  swiss_buf_release(buf);
+}
+
+
+int main(int argc, char **argv)
+{
+  test_basic();
+  test_ttl();
+  test_eviction();
+  test_shards();
+
+  if (failed) {
+    fprintf(stderr, "cache_test: %d failed\n", failed);
+    return (1);
+  }
+
+  printf("cache_test: ok\n");
+  return (0);
+}
@@ -0,0 +1,313 @@
+/*
+ * compress_test.c
+ *
+ *
+ * Swiss Module Compression Test
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+/*
+ * exercises compress_lib: the SipHash behind the cache key against the
+ * reference vectors, Accept-Encoding negotiation, and compressing with
+ * every coding built in and decompressing again. compress_lib.c is
+ * included directly so the hash and its seed can be reached.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../compress_lib.c"
+
+
+static int failed = 0;
+
+#define CHECK(cond, what) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "FAIL: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+      ++failed;								\
+    }									\
+  } while (0)
+
+
+#define PLAIN_LEN (64 * 1024)
+
+
+// gzip or zlib, zlib tells them apart by the header
+static size_t inflate_all(const uint8_t *data, const size_t len, uint8_t *out, const size_t out_len)
+{
+  z_stream zs;
+  size_t   total = 0;
+  int      ret;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    return (0);
+  }
+
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  zs.next_out = out;
+  zs.avail_out = out_len;
+  ret = inflate(&zs, Z_FINISH);
+  if (ret == Z_STREAM_END) {
+    total = zs.total_out;
+  }
+  inflateEnd(&zs);
+
+  return (total);
+}
+
+
+static size_t decompress(const int coding, const uint8_t *data, const size_t len, 
+			 uint8_t *out, const size_t out_len)
+{
+  if (coding == SWISS_COMPRESS_ZSTD) {
+#ifdef SWISS_HAVE_ZSTD
+    size_t ret = ZSTD_decompress(out, out_len, data, len);
+
+    return (ZSTD_isError(ret) ? 0 : ret);
+#else
+    return (0);
+#endif
+  }
+
+  return (inflate_all(data, len, out, out_len));
+}
+
+
+/*
+ * the 128 bit SipHash-2-4 vectors from the reference implementation,
+ * key 00..0f and messages 00, 01, .. of increasing length
+ */
+static void test_siphash()
+{
+  static const uint8_t expect_0[16] = {
+    0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6, 0x6d, 0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93
+  };
+  static const uint8_t expect_15[16] = {
+    0x54, 0x93, 0xe9, 0x99, 0x33, 0xb0, 0xa8, 0x11, 0x7e, 0x08, 0xec, 0x0f, 0x97, 0xcf, 0xc3, 0xd9
+  };
+  uint8_t  key[16];
+  uint8_t  msg[15];
+  uint64_t hash[2];
+  uint64_t other[2];
+  int      i;
+
+  // the seed is drawn once, take it before pinning the reference key over it
+  pthread_once(&compress_once, compress_init);
+
+  for (i = 0; i < 16; ++i) {
+    key[i] = i;
+  }
+  for (i = 0; i < 15; ++i) {
+    msg[i] = i;
+  }
+  memcpy(compress_seed, key, sizeof(key));
+
+  compress_hash(msg, 0, hash);
+  CHECK(!memcmp(hash, expect_0, sizeof(hash)), "siphash of the empty message");
+  compress_hash(msg, 15, hash);
+  CHECK(!memcmp(hash, expect_15, sizeof(hash)), "siphash of a block and a tail");
+
+  compress_seed[0] ^= 1;
+  compress_hash(msg, 15, other);
+  CHECK(memcmp(hash, other, sizeof(hash)), "the seed keys the hash");
+}
+
+
+static void test_negotiate()
+{
+  const int best = swiss_compress_supported(SWISS_COMPRESS_ZSTD) ? SWISS_COMPRESS_ZSTD : SWISS_COMPRESS_GZIP;
+
+  CHECK(swiss_compress_negotiate(NULL) == SWISS_COMPRESS_NONE, "no header");
+  CHECK(swiss_compress_negotiate("") == SWISS_COMPRESS_NONE, "empty header");
+  CHECK(swiss_compress_negotiate("identity") == SWISS_COMPRESS_NONE, "identity only");
+  CHECK(swiss_compress_negotiate("gzip, deflate") == SWISS_COMPRESS_GZIP, "gzip before deflate");
+  CHECK(swiss_compress_negotiate("deflate") == SWISS_COMPRESS_DEFLATE, "deflate alone");
+  CHECK(swiss_compress_negotiate("GZip;q=0.5") == SWISS_COMPRESS_GZIP, "tokens ignore case");
+  CHECK(swiss_compress_negotiate("x-gzip") == SWISS_COMPRESS_NONE, "no partial token matches");
+
+  // q=0 refuses a coding outright
+  CHECK(swiss_compress_negotiate("gzip;q=0, deflate") == SWISS_COMPRESS_DEFLATE, "gzip refused with q=0");
+  CHECK(swiss_compress_negotiate("gzip; q=0.0, deflate;q=0") == SWISS_COMPRESS_NONE, "everything refused");
+
+  // * covers whatever is not listed
+  CHECK(swiss_compress_negotiate("*") == best, "* allows the preferred coding");
+  CHECK(swiss_compress_negotiate("*;q=0") == SWISS_COMPRESS_NONE, "*;q=0 allows nothing");
+  CHECK(swiss_compress_negotiate("zstd;q=0, gzip;q=0, *") == SWISS_COMPRESS_DEFLATE, 
+	"listed q=0 wins over *");
+
+  CHECK(swiss_compress_accepts("br, gzip", "br") == 1, "br listed");
+  CHECK(swiss_compress_accepts("br;q=0, *", "br") == 0, "br refused despite *");
+  CHECK(swiss_compress_accepts("gzip, *;q=0.1", "br") == 1, "br through *");
+  CHECK(swiss_compress_accepts("gzip", "br") == 0, "br not listed");
+}
+
+
+static void test_round_trip()
+{
+  swiss_cache_st *cache;
+  swiss_buf_st   *buf;
+  swiss_buf_st   *again;
+  uint8_t        *plain;
+  uint8_t        *out;
+  size_t          len;
+  int             coding;
+  int             i;
+
+  plain = (uint8_t *)malloc(PLAIN_LEN);
+  out = (uint8_t *)malloc(PLAIN_LEN);
+  for (i = 0; i < PLAIN_LEN; ++i) {
+    plain[i] = "swiss cheese has holes "[i % 23] + (i / 4096);
+  }
+
+  cache = swiss_cache_create(1, 1 << 20);
+
+  for (coding = 0; coding < SWISS_COMPRESS_CODINGS; ++coding) {
+    if (!swiss_compress_supported(coding)) {
+      CHECK(swiss_compress_buf(NULL, coding, SWISS_COMPRESS_LEVEL_DEFAULT, plain, PLAIN_LEN) == NULL, 
+	    "a coding that is not built in compresses nothing");
+      continue;
+    }
+
+    buf = swiss_compress_buf(NULL, coding, SWISS_COMPRESS_LEVEL_DEFAULT, plain, PLAIN_LEN);
+    CHECK((buf) && (buf->len < PLAIN_LEN), swiss_compress_name(coding));
+    if (!buf) {
+      continue;
+    }
+    len = decompress(coding, buf->data, buf->len, out, PLAIN_LEN);
+    CHECK((len == PLAIN_LEN) && (!memcmp(out, plain, PLAIN_LEN)), "one shot round trip");
+    swiss_buf_release(buf);
+
+    // the second request for the same payload is served from the cache
+    buf = swiss_compress_buf(cache, coding, 1, plain, PLAIN_LEN);
+    again = swiss_compress_buf(cache, coding, 1, plain, PLAIN_LEN);
+    CHECK((buf) && (buf == again), "cached result reused");
+    if (buf) {
+      len = decompress(coding, buf->data, buf->len, out, PLAIN_LEN);
+      CHECK((len == PLAIN_LEN) && (!memcmp(out, plain, PLAIN_LEN)), "cached round trip");
+    }
+    swiss_buf_release(buf);
+    swiss_buf_release(again);
+  }
+
+  // noise does not shrink, that is remembered too
+  srand(1);
+  for (i = 0; i < 4096; ++i) {
+    plain[i] = rand();
+  }
+  CHECK(swiss_compress_buf(NULL, SWISS_COMPRESS_GZIP, 9, plain, 4096) == NULL, "noise is sent as is");
+  CHECK(swiss_compress_buf(cache, SWISS_COMPRESS_GZIP, 9, plain, 4096) == NULL, "noise is sent as is");
+  CHECK(swiss_compress_buf(cache, SWISS_COMPRESS_GZIP, 9, plain, 4096) == NULL, "noise remembered");
+
+  swiss_cache_destroy(cache);
+  free(plain);
+  free(out);
+}
+
+
+// a stream written in pieces through a pipe decompresses to the whole
+static void test_stream()
+{
+  swiss_compress_st *stream;
+  uint8_t            packed[PLAIN_LEN];
+  uint8_t            plain[PLAIN_LEN / 4];
+  uint8_t            out[PLAIN_LEN / 4];
+  int64_t            written;
+  ssize_t            got;
+  size_t             len;
+  int                fds[2];
+  int                coding;
+  int                i;
+
+  for (i = 0; i < (int)sizeof(plain); ++i) {
+    plain[i] = 'a' + (i % 7) * (i % 3);
+  }
+
+  for (coding = 0; coding < SWISS_COMPRESS_CODINGS; ++coding) {
+    if ((!swiss_compress_supported(coding)) || (pipe(fds) < 0)) {
+      continue;
+    }
+
+    CHECK((stream = swiss_compress_open(fds[1], coding, SWISS_COMPRESS_LEVEL_DEFAULT)) != NULL, 
+	  "stream opened");
+    if (!stream) {
+      close(fds[0]);
+      close(fds[1]);
+      continue;
+    }
+    swiss_compress_write(stream, plain, sizeof(plain) / 2);
+    swiss_compress_flush(stream);
+    swiss_compress_write(stream, plain + sizeof(plain) / 2, sizeof(plain) - sizeof(plain) / 2);
+    written = swiss_compress_close(stream);
+    close(fds[1]);
+
+    got = read(fds[0], packed, sizeof(packed));
+    close(fds[0]);
+    CHECK((written > 0) && (got == written), "close counts the bytes written");
+
+    len = decompress(coding, packed, (got > 0) ? got : 0, out, sizeof(out));
+    CHECK((len == sizeof(plain)) && (!memcmp(out, plain, sizeof(plain))), "stream round trip");
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  test_siphash();
+  test_negotiate();
+  test_round_trip();
+  test_stream();
+
+  if (failed) {
+    fprintf(stderr, "compress_test: %d failed\n", failed);
+    return (1);
+  }
+
+  printf("compress_test: ok\n");
+  return (0);
+}
@@ -0,0 +1,274 @@
+/*
+ * state_test.c
+ *
+ *
+ * Swiss Module Shared State Test
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+/*
+ * exercises state_lib without a core: put, get and remove while the
+ * table grows, bulk updates, and a save and load round trip through a
+ * snapshot file
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../state_lib.h"
+
+
+static int failed = 0;
+
+#define CHECK(cond, what) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "FAIL: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+      ++failed;								\
+    }									\
+  } while (0)
+
+
+// well past the point where a 64 bucket table doubles
+#define ENTRIES 5000
+
+
+static size_t key(char *buf, const int i)
+{
+  return (sprintf(buf, "key-%d", i));
+}
+
+
+static size_t value(char *buf, const int i, const int gen)
+{
+  return (sprintf(buf, "value-%d-%d", i, gen));
+}
+
+
+// every key in [0, count) holds generation gen, nothing past it is there
+static int holds(swiss_state_st *map, const int count, const int gen)
+{
+  char    k[32];
+  char    v[32];
+  char    got[32];
+  size_t  klen;
+  size_t  vlen;
+  int64_t len;
+  int     i;
+
+  for (i = 0; i < count; ++i) {
+    klen = key(k, i);
+    vlen = value(v, i, gen);
+    len = swiss_state_get(map, k, klen, got, sizeof(got));
+    if ((len != (int64_t)vlen) || (memcmp(got, v, vlen))) {
+      return (0);
+    }
+  }
+
+  klen = key(k, count);
+
+  return ((swiss_state_get(map, k, klen, got, sizeof(got)) == -1) && 
+	  (swiss_state_count(map) == (size_t)count));
+}
+
+
+static void test_growth()
+{
+  swiss_state_st *map;
+  const void     *found;
+  char            k[32];
+  char            v[32];
+  char            got[4];
+  size_t          vlen;
+  int             i;
+  int             removed;
+
+  CHECK((map = swiss_state_open("growth")) != NULL, "map opened");
+  CHECK(swiss_state_open("growth") == map, "the same name finds the same map");
+  CHECK(swiss_state_open("other") != map, "another name gets another map");
+
+  for (i = 0; i < ENTRIES; ++i) {
+    swiss_state_put(map, k, key(k, i), v, value(v, i, 0));
+  }
+  CHECK(holds(map, ENTRIES, 0), "every entry survives the table growing");
+
+  // overwrites keep the count
+  for (i = 0; i < ENTRIES; ++i) {
+    swiss_state_put(map, k, key(k, i), v, value(v, i, 1));
+  }
+  CHECK(holds(map, ENTRIES, 1), "overwrites replace values in place");
+
+  swiss_state_enter();
+  found = swiss_state_lookup(map, k, key(k, 7), &vlen);
+  CHECK((found) && (vlen == value(v, 7, 1)) && (!memcmp(found, v, vlen)), "lookup sees the value");
+  swiss_state_exit();
+
+  CHECK(swiss_state_get(map, k, key(k, 7), got, sizeof(got)) == (int64_t)value(v, 7, 1), 
+	"get returns the full length when the buffer is short");
+  CHECK(!memcmp(got, v, sizeof(got)), "get copies what fits");
+
+  removed = 0;
+  for (i = 0; i < ENTRIES; i += 2) {
+    removed += (swiss_state_remove(map, k, key(k, i)) == 0);
+  }
+  CHECK((removed == ENTRIES / 2) && (swiss_state_count(map) == ENTRIES / 2), "every other key removed");
+  CHECK((swiss_state_remove(map, k, key(k, 0)) == 0) && (swiss_state_count(map) == ENTRIES / 2), 
+	"removing a missing key changes nothing");
+  for (i = 0; i < ENTRIES; ++i) {
+    if ((swiss_state_get(map, k, key(k, i), got, sizeof(got)) == -1) != (i % 2 == 0)) {
+      break;
+    }
+  }
+  CHECK(i == ENTRIES, "only the removed keys are gone");
+}
+
+
+static void test_bulk()
+{
+  swiss_state_bulk_st *bulk;
+  swiss_state_st      *map;
+  char                 k[32];
+  char                 v[32];
+  int                  i;
+
+  map = swiss_state_open("bulk");
+  for (i = 0; i < 100; ++i) {
+    swiss_state_put(map, k, key(k, i), v, value(v, i, 0));
+  }
+
+  // staged changes stay out of sight until commit
+  CHECK((bulk = swiss_state_bulk_begin(map, 0)) != NULL, "bulk started");
+  for (i = 0; i < ENTRIES; ++i) {
+    swiss_state_bulk_put(bulk, k, key(k, i), v, value(v, i, 1));
+  }
+  CHECK(holds(map, 100, 0), "readers do not see a bulk before commit");
+  CHECK(swiss_state_bulk_commit(bulk) == 0, "bulk committed");
+  CHECK(holds(map, ENTRIES, 1), "commit publishes every staged put");
+
+  // replace drops whatever was not staged
+  bulk = swiss_state_bulk_begin(map, 1);
+  for (i = 0; i < 10; ++i) {
+    swiss_state_bulk_put(bulk, k, key(k, i), v, value(v, i, 2));
+  }
+  swiss_state_bulk_commit(bulk);
+  CHECK(holds(map, 10, 2), "a replacing bulk empties the map first");
+
+  bulk = swiss_state_bulk_begin(map, 0);
+  swiss_state_bulk_remove(bulk, k, key(k, 9));
+  swiss_state_bulk_put(bulk, k, key(k, 0), v, value(v, 0, 3));
+  swiss_state_bulk_abort(bulk);
+  CHECK(holds(map, 10, 2), "an aborted bulk changes nothing");
+
+  bulk = swiss_state_bulk_begin(map, 0);
+  swiss_state_bulk_remove(bulk, k, key(k, 9));
+  swiss_state_bulk_commit(bulk);
+  CHECK(holds(map, 9, 2), "a bulk remove lands on commit");
+}
+
+
+static void test_snapshot()
+{
+  swiss_state_st *map;
+  swiss_state_st *copy;
+  char            dir[] = "/tmp/state_test.XXXXXX";
+  char            path[64];
+  char            k[32];
+  char            v[32];
+  size_t          vlen;
+  FILE           *file;
+  int             i;
+
+  if (!mkdtemp(dir)) {
+    CHECK(0, "temporary directory");
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/snap", dir);
+
+  map = swiss_state_open("snapshot");
+  for (i = 0; i < ENTRIES; ++i) {
+    swiss_state_put(map, k, key(k, i), v, value(v, i, 4));
+  }
+
+  CHECK(swiss_state_save(map, path) == ENTRIES, "save counts every entry");
+
+  copy = swiss_state_open("snapshot-copy");
+  swiss_state_put(copy, "stale", 5, "x", 1);
+  CHECK(swiss_state_load(copy, path) == ENTRIES, "load counts every entry");
+  CHECK(holds(copy, ENTRIES, 4), "load replaces the map with the snapshot");
+
+  // a torn snapshot is refused and leaves the map alone
+  CHECK(truncate(path, 1000) == 0, "snapshot truncated");
+  swiss_state_put(copy, k, key(k, 0), v, (vlen = value(v, 0, 5)));
+  CHECK(swiss_state_load(copy, path) == -1, "a truncated snapshot fails to load");
+  CHECK((swiss_state_get(copy, k, key(k, 0), v, sizeof(v)) == (int64_t)vlen) && 
+	(swiss_state_count(copy) == ENTRIES), "a failed load keeps the map");
+
+  if ((file = fopen(path, "w")) != NULL) {
+    fputs("not a snapshot at all", file);
+    fclose(file);
+  }
+  CHECK(swiss_state_load(copy, path) == -1, "a file without the magic fails to load");
+  CHECK(swiss_state_load(copy, "/nonexistent/snap") == -1, "a missing file fails to load");
+
+  unlink(path);
+  rmdir(dir);
+}
+
+
+int main(int argc, char **argv)
+{
+  test_growth();
+  test_bulk();
+  test_snapshot();
+
+  if (failed) {
+    fprintf(stderr, "state_test: %d failed\n", failed);
+    return (1);
+  }
+
+  printf("state_test: ok\n");
+  return (0);
+}
@@ -0,0 +1,305 @@
+/*
+ * task_test.c
+ *
+ *
+ * Swiss Module Task Group Test
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+/*
+ * exercises swiss_parallel_for and swiss_parallel_reduce: inline with
+ * no core, empty ranges, a grain past the end of the range, and a
+ * stand-in core that runs chunks backwards so reduce has to put the
+ * partials back in order itself
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../module_lib.h"
+#include "../task_lib.h"
+
+
+static int failed = 0;
+
+#define CHECK(cond, what) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "FAIL: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+      ++failed;								\
+    }									\
+  } while (0)
+
+
+#define MAX_CHUNKS 64
+
+// the chunks fp was called with, in call order
+typedef struct calls_st {
+  size_t  begin[MAX_CHUNKS];
+  size_t  end[MAX_CHUNKS];
+  size_t  count;
+  uint8_t seen[1024];
+} calls_st;
+
+
+static void record(void *ctx, const size_t begin, const size_t end)
+{
+  calls_st *calls = (calls_st *)ctx;
+  size_t    i;
+
+  if (calls->count < MAX_CHUNKS) {
+    calls->begin[calls->count] = begin;
+    calls->end[calls->count] = end;
+  }
+  ++calls->count;
+
+  for (i = begin; i < end; ++i) {
+    ++calls->seen[i];
+  }
+}
+
+
+static int seen_once(const calls_st *calls, const size_t begin, const size_t end)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(calls->seen); ++i) {
+    if (calls->seen[i] != (((i >= begin) && (i < end)) ? 1 : 0)) {
+      return (0);
+    }
+  }
+
+  return (1);
+}
+
+
+// each partial is the chunk's first index
+static void map_begin(void *ctx, const size_t begin, const size_t end, void *partial)
+{
+  *(uint64_t *)partial = begin;
+}
+
+
+// appends the partial as a digit, so any reordering shows in the result
+static void combine_digits(void *ctx, void *result, const void *partial)
+{
+  *(uint64_t *)result = *(uint64_t *)result * 10 + *(const uint64_t *)partial / 10;
+}
+
+
+static void map_sum(void *ctx, const size_t begin, const size_t end, void *partial)
+{
+  size_t i;
+
+  for (i = begin; i < end; ++i) {
+    *(uint64_t *)partial += i;
+  }
+}
+
+
+static void combine_sum(void *ctx, void *result, const void *partial)
+{
+  *(uint64_t *)result += *(const uint64_t *)partial;
+}
+
+
+/*
+ * a stand-in for the core's pool that holds queued tasks back until
+ * the group is waited on and then runs them last first
+ */
+typedef struct fake_group_st {
+  void  (*fp[MAX_CHUNKS])(void *);
+  void   *opaques[MAX_CHUNKS];
+  size_t  count;
+} fake_group_st;
+
+static int fake_pool;
+
+static void *fake_create(void *pool)
+{
+  return (calloc(1, sizeof(fake_group_st)));
+}
+
+
+static void fake_run(void *opaque, void (*fp)(void *), void **opaques, const size_t count)
+{
+  fake_group_st *group = (fake_group_st *)opaque;
+  size_t         i;
+
+  for (i = 0; (i < count) && (group->count < MAX_CHUNKS); ++i) {
+    group->fp[group->count] = fp;
+    group->opaques[group->count++] = opaques[i];
+  }
+}
+
+
+static void fake_wait(void *opaque)
+{
+  fake_group_st *group = (fake_group_st *)opaque;
+
+  while (group->count) {
+    --group->count;
+    group->fp[group->count](group->opaques[group->count]);
+  }
+}
+
+
+static void fake_destroy(void *opaque)
+{
+  fake_wait(opaque);
+  free(opaque);
+}
+
+
+static void test_inline()
+{
+  calls_st calls;
+  uint64_t sum = 0;
+  size_t   i;
+
+  CHECK(swiss_core() == NULL, "no core outside a server");
+
+  memset(&calls, 0, sizeof(calls));
+  CHECK(swiss_parallel_for(0, 1000, 0, &record, &calls) == 0, "parallel_for runs");
+  CHECK(seen_once(&calls, 0, 1000), "every index visited once");
+  // no core is one thread, so the auto grain makes TASK_AUTO_CHUNKS chunks
+  CHECK(calls.count == 4, "auto grain without a core");
+  for (i = 0; (i < calls.count) && (i < MAX_CHUNKS); ++i) {
+    CHECK(calls.begin[i] == i * 250 && calls.end[i] == (i + 1) * 250, "chunks run in order inline");
+  }
+
+  memset(&calls, 0, sizeof(calls));
+  CHECK(swiss_parallel_for(10, 110, 30, &record, &calls) == 0, "parallel_for runs");
+  CHECK(seen_once(&calls, 10, 110), "every index visited once");
+  CHECK((calls.count == 4) && (calls.begin[3] == 100) && (calls.end[3] == 110), 
+	"the last chunk is cut short at the end");
+
+  CHECK(swiss_parallel_reduce(1, 101, 7, &map_sum, &combine_sum, NULL, &sum, sizeof(sum)) == 0, 
+	"parallel_reduce runs");
+  CHECK(sum == 5050, "reduce sums 1..100");
+
+  CHECK(swiss_parallel_for(0, 10, 1, NULL, &calls) == -1, "parallel_for needs a function");
+  CHECK(swiss_parallel_reduce(0, 10, 1, &map_sum, &combine_sum, NULL, &sum, 0) == -1, 
+	"parallel_reduce needs a result size");
+}
+
+
+static void test_empty()
+{
+  calls_st calls;
+  uint64_t sum = 42;
+
+  memset(&calls, 0, sizeof(calls));
+  CHECK(swiss_parallel_for(5, 5, 0, &record, &calls) == 0, "empty range succeeds");
+  CHECK(swiss_parallel_for(9, 5, 0, &record, &calls) == 0, "reversed range succeeds");
+  CHECK(calls.count == 0, "fp is not called on an empty range");
+
+  CHECK(swiss_parallel_reduce(5, 5, 0, &map_sum, &combine_sum, NULL, &sum, sizeof(sum)) == 0, 
+	"empty reduce succeeds");
+  CHECK(sum == 42, "empty reduce leaves the result alone");
+}
+
+
+static void test_big_grain()
+{
+  calls_st calls;
+  uint64_t sum = 0;
+
+  memset(&calls, 0, sizeof(calls));
+  CHECK(swiss_parallel_for(3, 20, 1000, &record, &calls) == 0, "parallel_for runs");
+  CHECK((calls.count == 1) && (calls.begin[0] == 3) && (calls.end[0] == 20), 
+	"a grain past the range is one chunk over the whole range");
+  CHECK(seen_once(&calls, 3, 20), "every index visited once");
+
+  CHECK(swiss_parallel_reduce(0, 10, SIZE_MAX, &map_sum, &combine_sum, NULL, &sum, sizeof(sum)) == 0, 
+	"parallel_reduce runs");
+  CHECK(sum == 45, "one chunk reduces the whole range");
+}
+
+
+static void test_order()
+{
+  swiss_core_ops_st ops;
+  calls_st          calls;
+  uint64_t          digits = 0;
+
+  memset(&ops, 0, sizeof(ops));
+  ops.pool = &fake_pool;
+  ops.threads = 1;
+  ops.group_create = &fake_create;
+  ops.group_run = &fake_run;
+  ops.group_wait = &fake_wait;
+  ops.group_destroy = &fake_destroy;
+  swiss_core_init(&ops);
+
+  memset(&calls, 0, sizeof(calls));
+  CHECK(swiss_parallel_for(0, 40, 10, &record, &calls) == 0, "parallel_for runs");
+  CHECK((calls.count == 4) && (calls.begin[0] == 30), "the stand-in pool runs chunks backwards");
+  CHECK(seen_once(&calls, 0, 40), "every index visited once");
+
+  // partials 1..9 come back 9..1, combining has to restore chunk order
+  CHECK(swiss_parallel_reduce(10, 100, 10, &map_begin, &combine_digits, NULL, 
+			      &digits, sizeof(digits)) == 0, "parallel_reduce runs");
+  CHECK(digits == 123456789, "partials combine in chunk order");
+
+  swiss_core_init(NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+  test_inline();
+  test_empty();
+  test_big_grain();
+  test_order();
+
+  if (failed) {
+    fprintf(stderr, "task_test: %d failed\n", failed);
+    return (1);
+  }
+
+  printf("task_test: ok\n");
+  return (0);
+}
@@ -0,0 +1,336 @@
+/*
+ * upstream_test.c
+ *
+ *
+ * Swiss Module Upstream Connection Pool Test
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+/*
+ * exercises upstream_lib against a stand-in backend on the loopback:
+ * connection reuse and the in-flight cap, marking a dead backend down
+ * and probing it back up, and proxying bulk data both ways at once
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#include "../upstream_lib.h"
+
+
+#define BULK_BYTES  (16 * 1024 * 1024)
+
+
+static int failed = 0;
+
+#define CHECK(cond, what) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "FAIL: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+      ++failed;								\
+    }									\
+  } while (0)
+
+
+typedef struct backend_st {
+  int       fd;
+  uint16_t  port;
+  int       bulk;     // 0 echoes, 1 sinks the request while sending BULK_BYTES
+  pthread_t thread;
+} backend_st;
+
+
+static void *bulk_source(void *arg)
+{
+  char    buf[65536];
+  int     fd = (int)(intptr_t)arg;
+  ssize_t sent;
+  size_t  left = BULK_BYTES;
+
+  memset(buf, 'u', sizeof(buf));
+  while (left) {
+    if ((sent = write(fd, buf, (left < sizeof(buf)) ? left : sizeof(buf))) <= 0) {
+      break;
+    }
+    left -= sent;
+  }
+  shutdown(fd, SHUT_WR);
+
+  return (NULL);
+}
+
+
+static void *backend_conn(void *arg)
+{
+  backend_st *be = (backend_st *)((intptr_t *)arg)[0];
+  int         fd = (int)((intptr_t *)arg)[1];
+  pthread_t   source;
+  char        buf[65536];
+  ssize_t     got;
+  uint64_t    total = 0;
+
+  free(arg);
+
+  if (be->bulk) {
+    pthread_create(&source, NULL, bulk_source, (void *)(intptr_t)fd);
+  }
+
+  while ((got = read(fd, buf, sizeof(buf))) > 0) {
+    total += got;
+    if ((!be->bulk) && (write(fd, buf, got) != got)) {
+      break;
+    }
+  }
+
+  if (be->bulk) {
+    pthread_join(source, NULL);
+    CHECK(total == BULK_BYTES, "backend received the whole request");
+  }
+
+  close(fd);
+
+  return (NULL);
+}
+
+
+static void *backend_accept(void *arg)
+{
+  backend_st *be = (backend_st *)arg;
+  intptr_t   *conn;
+  pthread_t   thread;
+  int         fd;
+
+  while ((fd = accept(be->fd, NULL, NULL)) >= 0) {
+    conn = (intptr_t *)malloc(2 * sizeof(intptr_t));
+    conn[0] = (intptr_t)be;
+    conn[1] = fd;
+    pthread_create(&thread, NULL, backend_conn, conn);
+    pthread_detach(thread);
+  }
+
+  return (NULL);
+}
+
+
+static int backend_start(backend_st *be, const uint16_t port, const int bulk)
+{
+  struct sockaddr_in addr;
+  socklen_t          len = sizeof(addr);
+  int                one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  be->bulk = bulk;
+  if (((be->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) || 
+      (setsockopt(be->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) || 
+      (bind(be->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || 
+      (listen(be->fd, 16) < 0) || 
+      (getsockname(be->fd, (struct sockaddr *)&addr, &len) < 0)) {
+    return (-1);
+  }
+  be->port = ntohs(addr.sin_port);
+
+  return (pthread_create(&be->thread, NULL, backend_accept, be));
+}
+
+
+static void backend_stop(backend_st *be)
+{
+  shutdown(be->fd, SHUT_RDWR);
+  pthread_join(be->thread, NULL);
+  close(be->fd);
+}
+
+
+static void test_pool()
+{
+  swiss_upstream_stats_st stats;
+  swiss_upstream_st      *up;
+  backend_st              be;
+  char                    buf[4];
+  int                     fd;
+  int                     fd2;
+
+  CHECK(backend_start(&be, 0, 0) == 0, "echo backend starts");
+  CHECK((up = swiss_upstream_create("127.0.0.1", be.port, 2, 1, 0)) != NULL, "pool created");
+
+  fd = swiss_upstream_acquire(up);
+  CHECK(fd != -1, "first acquire connects");
+  CHECK((write(fd, "ping", 4) == 4) && (read(fd, buf, 4) == 4) && (!memcmp(buf, "ping", 4)), 
+	"round trip through a pooled connection");
+
+  fd2 = swiss_upstream_acquire(up);
+  CHECK((fd2 == -1) && (errno == EAGAIN), "in-flight cap refuses a second connection");
+
+  swiss_upstream_release(up, fd, 1);
+  fd2 = swiss_upstream_acquire(up);
+  CHECK(fd2 == fd, "released connection is reused");
+  swiss_upstream_release(up, fd2, 0);
+
+  swiss_upstream_stats(up, &stats);
+  CHECK((stats.connects == 1) && (stats.reuses == 1) && (stats.idle == 0) && (!stats.in_flight), 
+	"pool stats add up");
+
+  swiss_upstream_destroy(up);
+  backend_stop(&be);
+}
+
+
+static void test_health()
+{
+  swiss_upstream_st *up;
+  backend_st         be;
+  uint16_t           port;
+  int                i;
+
+  // a port nothing listens on
+  CHECK(backend_start(&be, 0, 0) == 0, "placeholder backend starts");
+  port = be.port;
+  backend_stop(&be);
+
+  CHECK((up = swiss_upstream_create("127.0.0.1", port, 2, 0, 0)) != NULL, "pool created");
+
+  for (i = 0; i < 3; ++i) {
+    CHECK(swiss_upstream_acquire(up) == -1, "connect to a dead backend fails");
+  }
+  CHECK((swiss_upstream_acquire(up) == -1) && (errno == EHOSTDOWN), "dead backend is marked down");
+  CHECK(!swiss_upstream_check(up), "check reports the backend down");
+
+  CHECK(backend_start(&be, port, 0) == 0, "backend comes back on the same port");
+  usleep(1100 * 1000);
+  CHECK(swiss_upstream_check(up), "probe brings the backend back up");
+  CHECK(swiss_upstream_acquire(up) != -1, "acquire succeeds after recovery");
+
+  swiss_upstream_destroy(up);
+  backend_stop(&be);
+}
+
+
+static void *run_proxy(void *arg)
+{
+  int *fds = (int *)arg;
+
+  swiss_proxy(fds[0], fds[1]);
+  close(fds[0]);
+
+  return (NULL);
+}
+
+
+/*
+ * the client writes its whole request before reading anything while the
+ * backend streams its response at the same time, so neither direction
+ * may wait on the other
+ */
+static void test_proxy()
+{
+  swiss_upstream_st *up;
+  backend_st         be;
+  pthread_t          proxy;
+  char               buf[65536];
+  int                client[2];
+  int                fds[2];
+  ssize_t            moved;
+  size_t             left = BULK_BYTES;
+  uint64_t           total = 0;
+
+  CHECK(backend_start(&be, 0, 1) == 0, "bulk backend starts");
+  CHECK((up = swiss_upstream_create("127.0.0.1", be.port, 1, 0, 0)) != NULL, "pool created");
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, client) == 0, "client socket pair");
+
+  fds[0] = client[1];
+  fds[1] = swiss_upstream_acquire(up);
+  CHECK(fds[1] != -1, "proxy upstream acquired");
+  pthread_create(&proxy, NULL, run_proxy, fds);
+
+  memset(buf, 'c', sizeof(buf));
+  while (left) {
+    if ((moved = write(client[0], buf, (left < sizeof(buf)) ? left : sizeof(buf))) <= 0) {
+      break;
+    }
+    left -= moved;
+  }
+  shutdown(client[0], SHUT_WR);
+
+  while ((moved = read(client[0], buf, sizeof(buf))) > 0) {
+    total += moved;
+  }
+  CHECK(total == BULK_BYTES, "client received the whole response");
+
+  pthread_join(proxy, NULL);
+  swiss_upstream_release(up, fds[1], 0);
+  close(client[0]);
+
+  swiss_upstream_destroy(up);
+  backend_stop(&be);
+}
+
+
+int main(int argc, char **argv)
+{
+  // a proxy that stalls one direction on the other never gets here
+  alarm(30);
+
+  test_pool();
+  test_health();
+  test_proxy();
+
+  if (failed) {
+    fprintf(stderr, "upstream_test: %d failed\n", failed);
+    return (1);
+  }
+
+  printf("upstream_test: ok\n");
+  return (0);
+}
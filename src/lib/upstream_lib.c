@@ -0,0 +1,523 @@
+/*
+ * upstream_lib.c
+ *
+ *
+ * Swiss Module Upstream Connection Pool
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+#include "upstream_lib.h"
+
+
+#define UPSTREAM_CONNECT_MS  1000
+#define UPSTREAM_FAIL_MAX    3
+#define UPSTREAM_RETRY_MS    1000
+#define PROXY_PIPE_SIZE      65536
+// a proxied pair that moves nothing either way for this long is torn down
+#define PROXY_IDLE_MS        60000
+
+
+typedef struct idle_conn_st {
+  int      fd;
+  uint64_t since;
+} idle_conn_st;
+
+struct swiss_upstream_st {
+  pthread_mutex_t    lock;
+  struct sockaddr_in addr;
+  idle_conn_st      *idle;
+  uint32_t           idle_count;
+  uint32_t           max_idle;
+  uint32_t           in_flight;
+  uint32_t           max_in_flight;
+  uint32_t           idle_timeout;
+  uint32_t           fail_count;
+  uint64_t           retry_at;
+  uint64_t           connects;
+  uint64_t           reuses;
+  uint64_t           failures;
+  uint64_t           discarded;
+};
+
+
+static uint64_t upstream_now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+swiss_upstream_st *swiss_upstream_create(const char *host, const uint16_t port, 
+					 const uint32_t max_idle, const uint32_t max_in_flight, 
+					 const uint32_t idle_timeout_ms)
+{
+  swiss_upstream_st *up;
+  struct addrinfo    hints;
+  struct addrinfo   *res;
+
+  if ((!host) || (!port)) {
+    return (NULL);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    // todo: log error
+    return (NULL);
+  }
+
+  if ((up = (swiss_upstream_st *)calloc(1, sizeof(swiss_upstream_st))) == NULL) {
+    freeaddrinfo(res);
+    return (NULL);
+  }
+
+  memcpy(&up->addr, res->ai_addr, sizeof(up->addr));
+  up->addr.sin_port = htons(port);
+  freeaddrinfo(res);
+
+  if ((up->idle = (idle_conn_st *)calloc(max_idle ? max_idle : 1, sizeof(idle_conn_st))) == NULL) {
+    free(up);
+    return (NULL);
+  }
+
+  pthread_mutex_init(&up->lock, NULL);
+  up->max_idle = max_idle;
+  up->max_in_flight = max_in_flight;
+  up->idle_timeout = idle_timeout_ms;
+
+  return (up);
+}
+
+
+void swiss_upstream_destroy(swiss_upstream_st *up)
+{
+  uint32_t i;
+
+  if (!up) {
+    return;
+  }
+
+  for (i = 0; i < up->idle_count; ++i) {
+    close(up->idle[i].fd);
+  }
+
+  pthread_mutex_destroy(&up->lock);
+  free(up->idle);
+  free(up);
+}
+
+
+static int upstream_connect(const struct sockaddr_in *addr)
+{
+  struct pollfd pfd;
+  socklen_t len = sizeof(int);
+  int       err = 0;
+  int       one = 1;
+  int       fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    return (-1);
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    if (errno != EINPROGRESS) {
+      close(fd);
+      return (-1);
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if ((poll(&pfd, 1, UPSTREAM_CONNECT_MS) != 1) || 
+	(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err)) {
+      close(fd);
+      errno = err ? err : ETIMEDOUT;
+      return (-1);
+    }
+  }
+
+  // modules use the blocking swiss_* calls on the returned fd
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  return (fd);
+}
+
+
+/*
+ * an idle keep-alive connection is only usable if the peer has neither
+ * closed it nor sent anything unsolicited while it sat in the pool
+ */
+static int upstream_alive(const int fd)
+{
+  uint8_t byte;
+
+  return ((recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0) && 
+	  ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
+
+
+int swiss_upstream_acquire(swiss_upstream_st *up)
+{
+  uint64_t now;
+  int      fd = -1;
+
+  if (!up) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  now = upstream_now_ms();
+
+  pthread_mutex_lock(&up->lock);
+  if ((up->max_in_flight) && (up->in_flight >= up->max_in_flight)) {
+    pthread_mutex_unlock(&up->lock);
+    errno = EAGAIN;
+    return (-1);
+  }
+
+  // most recently used first, it is the least likely to have timed out
+  while (up->idle_count) {
+    idle_conn_st *conn = &up->idle[--up->idle_count];
+
+    if (((!up->idle_timeout) || (now - conn->since < up->idle_timeout)) && 
+	(upstream_alive(conn->fd))) {
+      fd = conn->fd;
+      ++up->reuses;
+      break;
+    }
+
+    close(conn->fd);
+    ++up->discarded;
+  }
+
+  if (fd == -1) {
+    if ((up->fail_count >= UPSTREAM_FAIL_MAX) && (now < up->retry_at)) {
+      pthread_mutex_unlock(&up->lock);
+      errno = EHOSTDOWN;
+      return (-1);
+    }
+  }
+
+  ++up->in_flight;
+  pthread_mutex_unlock(&up->lock);
+
+  if (fd != -1) {
+    return (fd);
+  }
+
+  fd = upstream_connect(&up->addr);
+
+  pthread_mutex_lock(&up->lock);
+  if (fd == -1) {
+    --up->in_flight;
+    ++up->failures;
+    if (++up->fail_count >= UPSTREAM_FAIL_MAX) {
+      up->retry_at = upstream_now_ms() + UPSTREAM_RETRY_MS;
+    }
+  } else {
+    ++up->connects;
+    up->fail_count = 0;
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  return (fd);
+}
+
+
+void swiss_upstream_release(swiss_upstream_st *up, int fd, const int reuse)
+{
+  if ((!up) || (fd == -1)) {
+    return;
+  }
+
+  pthread_mutex_lock(&up->lock);
+  --up->in_flight;
+  if ((reuse) && (up->idle_count < up->max_idle)) {
+    up->idle[up->idle_count].fd = fd;
+    up->idle[up->idle_count].since = upstream_now_ms();
+    ++up->idle_count;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+
+int swiss_upstream_check(swiss_upstream_st *up)
+{
+  uint64_t now;
+  uint32_t kept = 0;
+  uint32_t i;
+  int      probe = 0;
+  int      fd;
+
+  if (!up) {
+    return (0);
+  }
+
+  now = upstream_now_ms();
+
+  pthread_mutex_lock(&up->lock);
+  for (i = 0; i < up->idle_count; ++i) {
+    if (((!up->idle_timeout) || (now - up->idle[i].since < up->idle_timeout)) && 
+	(upstream_alive(up->idle[i].fd))) {
+      up->idle[kept++] = up->idle[i];
+    } else {
+      close(up->idle[i].fd);
+      ++up->discarded;
+    }
+  }
+  up->idle_count = kept;
+
+  if ((up->fail_count >= UPSTREAM_FAIL_MAX) && (now >= up->retry_at)) {
+    probe = 1;
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  if (probe) {
+    fd = upstream_connect(&up->addr);
+
+    pthread_mutex_lock(&up->lock);
+    if (fd == -1) {
+      up->retry_at = upstream_now_ms() + UPSTREAM_RETRY_MS;
+    } else {
+      up->fail_count = 0;
+      if (up->idle_count < up->max_idle) {
+	up->idle[up->idle_count].fd = fd;
+	up->idle[up->idle_count].since = now;
+	++up->idle_count;
+	fd = -1;
+      }
+    }
+    pthread_mutex_unlock(&up->lock);
+
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  return (up->fail_count < UPSTREAM_FAIL_MAX);
+}
+
+
+void swiss_upstream_stats(swiss_upstream_st *up, swiss_upstream_stats_st *stats)
+{
+  if ((!up) || (!stats)) {
+    return;
+  }
+
+  pthread_mutex_lock(&up->lock);
+  stats->idle = up->idle_count;
+  stats->in_flight = up->in_flight;
+  stats->connects = up->connects;
+  stats->reuses = up->reuses;
+  stats->failures = up->failures;
+  stats->discarded = up->discarded;
+  stats->healthy = (up->fail_count < UPSTREAM_FAIL_MAX);
+  pthread_mutex_unlock(&up->lock);
+}
+
+
+typedef struct proxy_dir_st {
+  int    from;
+  int    to;
+  int    pipe[2];
+  size_t pending;  // spliced in from from, not yet out to to
+  int    eof;
+  int    done;
+} proxy_dir_st;
+
+
+/*
+ * moves whatever is readable on dir->from into the pipe, once the pipe
+ * is empty, and then drains as much of it into dir->to as will go. it
+ * never blocks, so a peer that stops reading only stalls its own
+ * direction. the payload never leaves the kernel.
+ */
+static int64_t proxy_step(proxy_dir_st *dir)
+{
+  ssize_t moved;
+  int64_t total = 0;
+
+  if ((!dir->pending) && (!dir->eof)) {
+    moved = splice(dir->from, NULL, dir->pipe[1], NULL, PROXY_PIPE_SIZE, 
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == 0) {
+      dir->eof = 1;
+    } else if (moved < 0) {
+      if ((errno != EAGAIN) && (errno != EINTR)) {
+	return (-1);
+      }
+    } else {
+      dir->pending += moved;
+    }
+  }
+
+  while (dir->pending) {
+    if ((moved = splice(dir->pipe[0], NULL, dir->to, NULL, dir->pending, 
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0) {
+      if ((moved < 0) && (errno == EINTR)) {
+	continue;
+      }
+      if ((moved < 0) && (errno == EAGAIN)) {
+	break;
+      }
+      return (-1);
+    }
+    dir->pending -= moved;
+    total += moved;
+  }
+
+  if ((dir->eof) && (!dir->pending)) {
+    dir->done = 1;
+    shutdown(dir->to, SHUT_WR);
+  }
+
+  return (total);
+}
+
+
+int64_t swiss_proxy(int client_fd, int upstream_fd)
+{
+  proxy_dir_st  dirs[2];
+  struct pollfd fds[2];
+  int64_t       total = 0;
+  int64_t       moved;
+  int           flags[2];
+  int           ready;
+  int           i;
+
+  if ((client_fd == -1) || (upstream_fd == -1)) {
+    return (-1);
+  }
+
+  memset(dirs, 0, sizeof(dirs));
+  dirs[0].from = client_fd;
+  dirs[0].to = upstream_fd;
+  dirs[1].from = upstream_fd;
+  dirs[1].to = client_fd;
+
+  if (pipe2(dirs[0].pipe, O_CLOEXEC) < 0) {
+    return (-1);
+  }
+  if (pipe2(dirs[1].pipe, O_CLOEXEC) < 0) {
+    close(dirs[0].pipe[0]);
+    close(dirs[0].pipe[1]);
+    return (-1);
+  }
+
+  // older kernels ignore SPLICE_F_NONBLOCK on the socket end
+  // so the sockets go nonblocking for the duration
+  flags[0] = fcntl(client_fd, F_GETFL);
+  flags[1] = fcntl(upstream_fd, F_GETFL);
+  fcntl(client_fd, F_SETFL, flags[0] | O_NONBLOCK);
+  fcntl(upstream_fd, F_SETFL, flags[1] | O_NONBLOCK);
+
+  while ((!dirs[0].done) || (!dirs[1].done)) {
+    // a direction with data in its pipe waits for room on the far side
+    for (i = 0; i < 2; ++i) {
+      fds[i].fd = dirs[i].done ? -1 : (dirs[i].pending ? dirs[i].to : dirs[i].from);
+      fds[i].events = dirs[i].pending ? POLLOUT : POLLIN;
+      fds[i].revents = 0;
+    }
+
+    if ((ready = poll(fds, 2, PROXY_IDLE_MS)) <= 0) {
+      if ((ready < 0) && (errno == EINTR)) {
+	continue;
+      }
+      // a silent peer would otherwise hold this thread and the upstream connection for good
+      if (ready == 0) {
+	shutdown(client_fd, SHUT_RDWR);
+	shutdown(upstream_fd, SHUT_RDWR);
+	errno = ETIMEDOUT;
+      }
+      total = -1;
+      break;
+    }
+
+    for (i = 0; i < 2; ++i) {
+      if ((fds[i].revents) && ((moved = proxy_step(&dirs[i])) >= 0)) {
+	total += moved;
+      } else if (fds[i].revents) {
+	dirs[0].done = dirs[1].done = 1;
+	total = -1;
+	break;
+      }
+    }
+  }
+
+  fcntl(client_fd, F_SETFL, flags[0]);
+  fcntl(upstream_fd, F_SETFL, flags[1]);
+
+  for (i = 0; i < 2; ++i) {
+    close(dirs[i].pipe[0]);
+    close(dirs[i].pipe[1]);
+  }
+
+  return (total);
+}
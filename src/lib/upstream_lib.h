@@ -0,0 +1,109 @@
+/*
+ * upstream_lib.h
+ *
+ *
+ * Swiss Module Upstream Connection Pool
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_UPSTREAM_LIB__
+#define __SWISS_UPSTREAM_LIB__
+
+#include <stdint.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/*
+ * Keep-alive connection pool for a single backend target. Modules
+ * create one per backend in load(), and acquire/release around each
+ * request in work() rather than connecting every time.
+ */
+typedef struct swiss_upstream_st swiss_upstream_st;
+
+typedef struct swiss_upstream_stats_st {
+  uint32_t idle;
+  uint32_t in_flight;
+  uint64_t connects;
+  uint64_t reuses;
+  uint64_t failures;
+  uint64_t discarded;
+  int      healthy;
+} swiss_upstream_stats_st;
+
+swiss_upstream_st *swiss_upstream_create(const char *host, const uint16_t port, 
+					 const uint32_t max_idle, const uint32_t max_in_flight, 
+					 const uint32_t idle_timeout_ms);
+void swiss_upstream_destroy(swiss_upstream_st *up);
+
+/*
+ * returns a connected fd, or -1 with errno set to EAGAIN when
+ * max_in_flight connections are already out, or EHOSTDOWN while the
+ * target is marked unhealthy.
+ */
+int swiss_upstream_acquire(swiss_upstream_st *up);
+
+/* reuse is 0 if the connection must not be kept alive (error, close) */
+void swiss_upstream_release(swiss_upstream_st *up, int fd, const int reuse);
+
+/* prunes dead and expired idle connections, probes a down target */
+int swiss_upstream_check(swiss_upstream_st *up);
+
+void swiss_upstream_stats(swiss_upstream_st *up, swiss_upstream_stats_st *stats);
+
+
+/*
+ * shuttles bytes both ways between client and upstream with splice()
+ * until both sides have closed. returns the bytes moved or -1. a pair
+ * idle for PROXY_IDLE_MS is shut down both ways and fails with
+ * ETIMEDOUT, release the upstream without reuse.
+ */
+int64_t swiss_proxy(int client_fd, int upstream_fd);
+
+
+#ifdef __cplusplus 
+}
+#endif
+
+
+#endif
@@ -46,33 +46,251 @@
  */
 
 
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
 
 #include "module_manager.hpp"
+#include "supervisor.hpp"
+#include "profiler.hpp"
 
-int main(int argc, char *argv[])
+// length of a capture started by SIGUSR2
+#define PROFILE_SECONDS 10
+
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump = 0;
+static volatile sig_atomic_t profile = 0;
+static uint32_t profile_secs = PROFILE_SECONDS;
+
+static void signalHandler(int sig)
+{
+  if (sig == SIGUSR1) {
+    dump = 1;
+  } else if (sig == SIGUSR2) {
+    profile = 1;
+  } else {
+    running = 0;
+  }
+}
+
+static void usage()
+{
+  std::cout << "usage: swiss [-w workers] [-n] [-m threads] [-r rate] [-b burst] [-c conns] [-s bits] [-t ms] [-l cpus] [-p secs] [-C dir] [-S mb] [-T n] module_path\n"
+	    << "  -w  prefork this many worker processes under a supervisor\n"
+	    << "  -n  pin each worker to a NUMA node (with -w)\n"
+	    << "  -m  let each server's pool grow to this many threads under load\n"
+	    << "  -r  new connections per second allowed per client\n"
+	    << "  -b  burst of new connections allowed per client (default rate)\n"
+	    << "  -c  open connections allowed per client\n"
+	    << "  -s  address prefix bits that identify a client (default 32)\n"
+	    << "  -t  hold rejected connections this many ms instead of resetting\n"
+	    << "  -l  low latency: spin on the cpu list (i.e. 2-5) instead of sleeping\n"
+	    << "  -p  seconds to profile for on SIGUSR2 (default 10)\n"
+	    << "  -C  capture request traffic per module into this directory\n"
+	    << "  -S  MB each capture file holds, allocated up front per port and worker (default 64)\n"
+	    << "  -T  time the phases of one request in n, shown on SIGUSR1\n";
+}
+
+// samples every thread, then writes folded stacks for flamegraph.pl
+static void runProfile()
+{
+  static uint32_t seq = 0;
+  std::ostringstream out;
+  std::string folded;
+  char path[64];
+  unsigned int remaining = profile_secs;
+  size_t done = 0;
+  ssize_t ret;
+  int fd;
+
+  if (!Profiler::start()) {
+    return;
+  }
+
+  while ((running) && (remaining)) {
+    remaining = sleep(remaining);
+  }
+
+  Profiler::stop();
+
+  Profiler::write(out);
+  folded = out.str();
+
+  // /tmp is shared, never follow or reuse a file someone else put at the name
+  snprintf(path, sizeof(path), "/tmp/swiss.%d.%u.folded", getpid(), seq++);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+    std::cerr << "Profile not written, " << path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+
+  while (done < folded.size()) {
+    if ((ret = write(fd, folded.data() + done, folded.size() - done)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    done += ret;
+  }
+  close(fd);
+
+  if (done < folded.size()) {
+    std::cerr << "Profile not written, " << path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+
+  std::cout << "Profile written to " << path << std::endl;
+}
+
+// module dlopen happens once up front, load() runs in each worker
+static int serve(worker_stats_st *stats, void *opaque)
 {
-  if (argc != 2) {
-    std::cout << "usage: swiss module_path\n";
+  ModuleManager *swiss_mm = static_cast<ModuleManager *>(opaque);
+  worker_stats_st local_stats;
+  struct sigaction sa;
+
+  // without a supervisor keep the counters here and print them on SIGUSR1
+  if (!stats) {
+    memset(&local_stats, 0, sizeof(local_stats));
+    local_stats.pid = getpid();
+    local_stats.node = -1;
+    stats = &local_stats;
+  }
+
+  swiss_mm->config().stats = stats;
+
+  try {
+    swiss_mm->modLoad();
+  } catch (const char* msg) {
+    std::cout << "Exception: " << msg << std::endl;
+    return (EXIT_FAILURE);
+  }
+
+  if (!swiss_mm->count()) {
+    std::cout << "No modules loaded" << std::endl;
     return (EXIT_FAILURE);
   }
-  
+
+  std::cout << "Ready: " << swiss_mm->count() << " module(s) loaded" << std::endl;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &signalHandler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  while (running) {
+    pause();
+    // under a supervisor it prints the counters, workers add their timings
+    if (dump) {
+      dump = 0;
+      if (stats == &local_stats) {
+	dumpWorkerStats(std::cout, *stats);
+      }
+      swiss_mm->dumpTiming(std::cout);
+    }
+    if (profile) {
+      profile = 0;
+      runProfile();
+    }
+  }
+
+  swiss_mm->modUnload();
+
+  return (EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
   ModuleManager swiss_mm;
+  server_config_st &config = swiss_mm.config();
+  uint32_t workers = 0;
+  bool numa = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:nm:r:b:c:s:t:l:p:C:S:T:")) != -1) {
+    switch (opt) {
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'n':
+      numa = true;
+      break;
+    case 'm':
+      config.max_threads = atoi(optarg);
+      break;
+    case 'r':
+      config.limit_rate = atoi(optarg);
+      break;
+    case 'b':
+      config.limit_burst = atoi(optarg);
+      break;
+    case 'c':
+      config.limit_conns = atoi(optarg);
+      break;
+    case 's':
+      config.limit_prefix = atoi(optarg);
+      break;
+    case 't':
+      config.tarpit_ms = atoi(optarg);
+      break;
+    case 'l':
+      config.low_latency = true;
+      ThreadPool::parseCpuList(optarg, config.spin_cpus);
+      break;
+    case 'p':
+      profile_secs = atoi(optarg);
+      break;
+    case 'C':
+      config.capture_dir = optarg;
+      break;
+    case 'S':
+      if ((config.capture_limit = strtoull(optarg, NULL, 10) * 1024 * 1024) == 0) {
+	usage();
+	return (EXIT_FAILURE);
+      }
+      break;
+    case 'T':
+      config.timing_sample = atoi(optarg);
+      break;
+    default:
+      usage();
+      return (EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+    return (EXIT_FAILURE);
+  }
 
   try {
-    swiss_mm.loadModules(argv[1]);
-    swiss_mm.modLoad();
+    swiss_mm.loadModules(argv[optind]);
   } catch (const char* msg) {
     std::cout << "Exception: " << msg << std::endl;
     return (EXIT_FAILURE);
   }
 
-  while (true) {
-    ;
+  if (!workers) {
+    return (serve(NULL, &swiss_mm));
   }
 
-  swiss_mm.modUnload();
+  config.reuse_port = true;
 
-  return (EXIT_SUCCESS);
+  try {
+    Supervisor supervisor(workers, numa, &serve, &swiss_mm);
+    return (supervisor.run());
+  } catch (const char* msg) {
+    std::cout << "Exception: " << msg << std::endl;
+    return (EXIT_FAILURE);
+  }
 }
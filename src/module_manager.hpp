@@ -55,96 +55,276 @@
 #include <vector>
 #include <cstring>
 #include <cassert>
+#include <iostream>
+#include <algorithm>
 
+#include <limits.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "swiss_server.hpp"
 
+// upper bound on modules being opened or loaded at the same time
+#define MODULE_LOAD_THREADS 16
+
 
 class ModuleManager {
 
 public:
-  ModuleManager() {}
+  ModuleManager()
+  {
+    initShared();
+  }
+
   ModuleManager(const char* module_dir)
   {
+    initShared();
     loadModules(module_dir);
   }
   
+  /*
+   * Opens every module in module_dir in parallel. Symbols are bound
+   * eagerly so a bad module is caught here rather than on its first
+   * request, and a module that fails is reported and skipped instead
+   * of taking the rest down with it.
+   */
   void loadModules(const char *module_dir)
   {
     DIR *dir;
     struct dirent *ent;
+    std::vector<module_st> found;
     
     if ((dir = opendir(module_dir)) == NULL) {
       throw "Modules directory does not exist";
     }
     
     while ((ent = readdir(dir)) != NULL) {
-      module_st mod;
-      char path[PATH_MAX];
       if (ent->d_type == DT_REG) {
-	memset(path, 0, PATH_MAX);
-	snprintf(path, PATH_MAX, "%s%s", module_dir, ent->d_name);
-	
-	mod.handle = dlopen(path, RTLD_LAZY);
-	if (!mod.handle) {
-	  throw "dlopen failed on module";
-	}
-	
-	mod.fps = new module_fps_st;
-	
-	mod.fps->load = (int (*)())dlsym(mod.handle, "load");
-	if (!mod.fps->load) {
-	  throw "module did not contain load symbol";
-	}
-	
-	mod.fps->work = (void (*)(void *))dlsym(mod.handle, "work");
-	if (!mod.fps->work) {
-	  throw "module did not contain work symbol";
-	}
-	
-	mod.fps->unload = (int (*)())dlsym(mod.handle, "unload");
-	if (!mod.fps->unload) {
-	  throw "module did not contain unload symbol";
-	}
-	
-	module_list_.push_back(mod);
+	module_st mod;
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/%s", module_dir, ent->d_name);
+	mod.path = path;
+	found.push_back(mod);
       }
     }
     closedir(dir);
+
+    parallelRun(found, &openEntry);
+
+    for (unsigned int i = 0; i < found.size(); ++i) {
+      if (found[i].error.empty()) {
+	module_list_.push_back(found[i]);
+      } else {
+	isolate(found[i]);
+      }
+    }
   }
   
+  /*
+   * Runs every module's load() in parallel, then brings up a server per
+   * module. Listeners are bound and worker threads running before this
+   * returns, so the first request does not pay for any of it.
+   */
   void modLoad()
   {
+    std::vector<module_st> loaded;
+
+    /*
+     * shared state is usable from load() on. the full table is a second
+     * copy the server completes before it is handed over, the one the
+     * module already holds is never written again.
+     */
+    for (unsigned int i = 0; i < module_list_.size(); ++i) {
+      module_st &mod = module_list_[i];
+
+      if (mod.fps->core_init) {
+	mod.ops = new swiss_core_ops_st[2];
+	memset(mod.ops, 0, sizeof(swiss_core_ops_st) * 2);
+	mod.ops[0].shared = &shared_;
+	mod.ops[1].shared = &shared_;
+	mod.fps->core_init(&mod.ops[0]);
+      }
+    }
+
+    parallelRun(module_list_, &loadEntry);
+
     for (unsigned int i = 0; i < module_list_.size(); ++i) {
-      server_list_.push_back(SwissServer(4, module_list_[i].fps->load(), module_list_[i].fps->work));
-      server_list_[server_list_.size() - 1].start();
+      module_st &mod = module_list_[i];
+
+      if (mod.error.empty()) {
+	try {
+	  mod.server = new SwissServer(config_, mod.port, mod.fps->work, mod.fps->classify, 
+				       mod.fps->work_batch);
+	  if (mod.ops) {
+	    mod.server->setCoreOps(&mod.ops[1], mod.fps->core_init);
+	  }
+	  mod.server->start();
+	} catch (const char *msg) {
+	  mod.error = msg;
+	  delete mod.server;
+	  mod.server = NULL;
+	}
+      }
+
+      if (mod.error.empty()) {
+	loaded.push_back(mod);
+      } else {
+	isolate(mod);
+      }
     }
+
+    module_list_.swap(loaded);
   }
 
   void modUnload()
   {
     for (unsigned int i = 0; i < module_list_.size(); ++i) {
-      server_list_[i].stop();
+      module_list_[i].server->stop();
       assert(module_list_[i].fps->unload() == 0);
     }
   }
+
+  size_t count() const
+  {
+    return (module_list_.size());
+  }
+
+  void dumpTiming(std::ostream &out)
+  {
+    for (unsigned int i = 0; i < module_list_.size(); ++i) {
+      module_list_[i].server->dumpTiming(out);
+    }
+  }
+
+  // applied to every server started by modLoad
+  server_config_st &config()
+  {
+    return (config_);
+  }
   
 private:
   typedef struct module_fps_st {
     int (*load)(void);
     void (*work)(void *opqaue);
     int (*unload)(void);
+    void (*classify)(swiss_work_st *work);
+    void (*work_batch)(swiss_work_st **works, size_t count);
+    void (*core_init)(const swiss_core_ops_st *ops);
   } module_fps_st;
 
   typedef struct module_st {
+    std::string path;
+    std::string error;
     module_fps_st *fps;
     void *handle;
+    int port;
+    bool loaded;
+    SwissServer *server;
+    swiss_core_ops_st *ops;   // the table load() sees, then the complete one
+
+    module_st() : fps(NULL), handle(NULL), port(0), loaded(false), server(NULL), ops(NULL) {}
   } module_st;
+
+  static void *openEntry(void *opaque)
+  {
+    module_st *mod = static_cast<module_st *>(opaque);
+
+    mod->handle = dlopen(mod->path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!mod->handle) {
+      mod->error = dlerror();
+      return (NULL);
+    }
+
+    mod->fps = new module_fps_st;
+
+    mod->fps->load = (int (*)())dlsym(mod->handle, "load");
+    if (!mod->fps->load) {
+      mod->error = "module did not contain load symbol";
+      return (NULL);
+    }
+
+    mod->fps->work = (void (*)(void *))dlsym(mod->handle, "work");
+    if (!mod->fps->work) {
+      mod->error = "module did not contain work symbol";
+      return (NULL);
+    }
+
+    mod->fps->unload = (int (*)())dlsym(mod->handle, "unload");
+    if (!mod->fps->unload) {
+      mod->error = "module did not contain unload symbol";
+    }
+
+    mod->fps->classify = (void (*)(swiss_work_st *))dlsym(mod->handle, "classify");
+    mod->fps->work_batch = (void (*)(swiss_work_st **, size_t))dlsym(mod->handle, "work_batch");
+
+    // only present if the module uses library services backed by the core
+    mod->fps->core_init = (void (*)(const swiss_core_ops_st *))dlsym(mod->handle, "swiss_core_init");
+
+    return (NULL);
+  }
+
+  static void *loadEntry(void *opaque)
+  {
+    module_st *mod = static_cast<module_st *>(opaque);
+
+    mod->port = mod->fps->load();
+    // anything above zero means load() set the module up, even if the port is unusable
+    mod->loaded = (mod->port > 0);
+    if ((mod->port <= 0) || (mod->port > 65535)) {
+      mod->error = "module load failed";
+    }
+
+    return (NULL);
+  }
+
+  static void parallelRun(std::vector<module_st> &mods, void *(*fp)(void *))
+  {
+    std::vector<pthread_t> threads(MODULE_LOAD_THREADS);
+
+    for (unsigned int base = 0; base < mods.size(); base += MODULE_LOAD_THREADS) {
+      unsigned int count = std::min<size_t>(MODULE_LOAD_THREADS, mods.size() - base);
+
+      for (unsigned int i = 0; i < count; ++i) {
+	if (pthread_create(&threads[i], NULL, fp, &mods[base + i]) != 0) {
+	  // no thread to spare, do it here
+	  threads[i] = pthread_self();
+	  fp(&mods[base + i]);
+	}
+      }
+
+      for (unsigned int i = 0; i < count; ++i) {
+	if (!pthread_equal(threads[i], pthread_self())) {
+	  pthread_join(threads[i], NULL);
+	}
+      }
+    }
+  }
+
+  void initShared()
+  {
+    memset(&shared_, 0, sizeof(shared_));
+    pthread_mutex_init(&shared_.lock, NULL);
+  }
+
+  static void isolate(module_st &mod)
+  {
+    std::cout << "Module " << mod.path << " disabled: " << mod.error << std::endl;
+
+    if (mod.loaded) {
+      mod.fps->unload();
+    }
+    if (mod.handle) {
+      dlclose(mod.handle);
+    }
+    delete mod.fps;
+    delete [] mod.ops;
+  }
   
   std::vector<module_st> module_list_;
-  std::vector<SwissServer> server_list_;
+  server_config_st config_;
+  swiss_shared_st shared_;
 };
 
 
@@ -0,0 +1,840 @@
+/*
+ * static_files.cc
+ *
+ *
+ * Static Content Swiss Loadable Module
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <list>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <poll.h>
+
+#include "include/module.h"
+#include "lib/module_lib.h"
+#include "lib/compress_lib.h"
+
+#define STATIC_DEFAULT_PORT 8081
+#define STATIC_DEFAULT_ROOT "/var/www"
+// files up to this size are read into memory and sent with a single writev
+#define STATIC_BUFFER_MAX    (256 * 1024)
+// total bytes held that way, larger files and files past this go out with sendfile
+#define STATIC_BUFFER_BUDGET (64 * 1024 * 1024)
+#define STATIC_REQ_MAX      8192
+#define STATIC_HDR_MAX      1024
+// entries (open files and misses) the cache holds before evicting
+#define STATIC_CACHE_MAX    4096
+// buffered text files without a precompressed sibling are compressed on the fly
+#define STATIC_COMPRESS_LEVEL  6
+#define STATIC_COMPRESS_SHARDS 16
+#define STATIC_COMPRESS_BUDGET (32 * 1024 * 1024)
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+		    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+/*
+ * An open file (or a cached miss, fd == -1) keyed by its path under the
+ * document root. Entries are refcounted so an invalidation never closes
+ * a descriptor that a worker is still sending from. Once the cache is
+ * full, entries are evicted in CLOCK order: a hit sets referenced, which
+ * buys the entry one more pass.
+ *
+ * Small files are copied into a private buffer rather than mapped, a
+ * file truncated under a shared mapping would SIGBUS the server on the
+ * next send. sendfile just comes up short.
+ */
+typedef struct file_entry_st {
+  int          fd;
+  struct stat  st;
+  uint8_t     *data;
+  char         etag[64];
+  uint32_t     refs;
+  volatile bool referenced;
+  std::list<std::string>::iterator order;
+} file_entry_st;
+
+typedef struct request_st {
+  bool        head;
+  std::string path;
+  std::string if_none_match;
+  std::string range;
+  std::string accept_encoding;
+} request_st;
+
+
+static std::string doc_root;
+static std::map<std::string, file_entry_st *> file_cache;
+static std::list<std::string> cache_order;
+static std::map<int, std::string> watch_dirs;
+static std::map<std::string, int> watched;
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int inotify_fd = -1;
+static int stop_pipe[2] = {-1, -1};
+static pthread_t watch_thread;
+static size_t buffered_bytes = 0;
+// keyed by content, so an edited file simply stops being asked for
+static swiss_cache_st *compress_cache = NULL;
+
+
+static const struct {
+  const char *ext;
+  const char *type;
+} mime_types[] = {
+  {".html", "text/html"},
+  {".htm",  "text/html"},
+  {".css",  "text/css"},
+  {".js",   "application/javascript"},
+  {".json", "application/json"},
+  {".txt",  "text/plain"},
+  {".xml",  "application/xml"},
+  {".svg",  "image/svg+xml"},
+  {".png",  "image/png"},
+  {".jpg",  "image/jpeg"},
+  {".jpeg", "image/jpeg"},
+  {".gif",  "image/gif"},
+  {".ico",  "image/x-icon"},
+  {".woff2", "font/woff2"},
+  {".pdf",  "application/pdf"},
+  {NULL,    NULL}
+};
+
+static const struct {
+  const char *token;
+  const char *suffix;
+} encodings[] = {
+  {"br",   ".br"},
+  {"gzip", ".gz"},
+  {NULL,   NULL}
+};
+
+
+static const char *mime_type(const std::string &path)
+{
+  size_t dot = path.rfind('.');
+
+  if (dot != std::string::npos) {
+    for (int i = 0; mime_types[i].ext; ++i) {
+      if (strcasecmp(path.c_str() + dot, mime_types[i].ext) == 0) {
+	return (mime_types[i].type);
+      }
+    }
+  }
+
+  return ("application/octet-stream");
+}
+
+
+static bool compressible(const char *type)
+{
+  return ((strncmp(type, "text/", 5) == 0) || (strstr(type, "javascript")) || 
+	  (strstr(type, "json")) || (strstr(type, "xml")));
+}
+
+
+static void entry_release(file_entry_st *entry)
+{
+  if (__sync_sub_and_fetch(&entry->refs, 1) == 0) {
+    if (entry->data) {
+      free(entry->data);
+      __sync_fetch_and_sub(&buffered_bytes, entry->st.st_size);
+    }
+    if (entry->fd != -1) {
+      close(entry->fd);
+    }
+    delete entry;
+  }
+}
+
+
+// caller holds cache_lock for writing
+static void cache_remove(std::map<std::string, file_entry_st *>::iterator it)
+{
+  cache_order.erase(it->second->order);
+  entry_release(it->second);
+  file_cache.erase(it);
+}
+
+
+// caller holds cache_lock for writing
+static void cache_invalidate(const std::string &path)
+{
+  std::map<std::string, file_entry_st *>::iterator it = file_cache.find(path);
+
+  if (it != file_cache.end()) {
+    cache_remove(it);
+  }
+}
+
+
+// caller holds cache_lock for writing
+static void cache_invalidate_dir(const std::string &dir)
+{
+  std::string prefix = dir + "/";
+  std::map<std::string, file_entry_st *>::iterator it = file_cache.lower_bound(prefix);
+
+  while ((it != file_cache.end()) && (it->first.compare(0, prefix.size(), prefix) == 0)) {
+    cache_remove(it++);
+  }
+}
+
+
+// caller holds cache_lock for writing
+static void cache_flush()
+{
+  while (!file_cache.empty()) {
+    cache_remove(file_cache.begin());
+  }
+}
+
+
+// caller holds cache_lock for writing, makes room for one more entry
+static void cache_evict()
+{
+  while (file_cache.size() >= STATIC_CACHE_MAX) {
+    std::map<std::string, file_entry_st *>::iterator it = file_cache.find(cache_order.front());
+
+    if (it->second->referenced) {
+      it->second->referenced = false;
+      cache_order.splice(cache_order.end(), cache_order, cache_order.begin());
+    } else {
+      cache_remove(it);
+    }
+  }
+}
+
+
+/*
+ * caller holds cache_lock for writing. fails for a directory that
+ * doesn't exist (yet), nothing under it may be cached then since its
+ * creation would go unnoticed.
+ */
+static bool watch_dir(const std::string &path)
+{
+  std::string dir = path.substr(0, path.rfind('/'));
+  int wd;
+
+  if (watched.find(dir) != watched.end()) {
+    return (true);
+  }
+
+  if ((wd = inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK)) < 0) {
+    return (false);
+  }
+
+  watched[dir] = wd;
+  watch_dirs[wd] = dir;
+
+  return (true);
+}
+
+
+static void *watchEntry(void *)
+{
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+
+  fds[0].fd = inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_pipe[0];
+  fds[1].events = POLLIN;
+
+  while (true) {
+    ssize_t len;
+
+    if (poll(fds, 2, -1) < 0) {
+      continue;
+    }
+
+    if (fds[1].revents) {
+      break;
+    }
+
+    if ((len = read(inotify_fd, buffer, sizeof(buffer))) <= 0) {
+      continue;
+    }
+
+    pthread_rwlock_wrlock(&cache_lock);
+    for (char *p = buffer; p < buffer + len; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      std::map<int, std::string>::iterator dir = watch_dirs.find(ev->wd);
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+	cache_flush();
+      } else if (dir != watch_dirs.end()) {
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+	  cache_invalidate_dir(dir->second);
+	  if (ev->mask & IN_IGNORED) {
+	    watched.erase(dir->second);
+	    watch_dirs.erase(dir);
+	  }
+	} else if (ev->len) {
+	  cache_invalidate(dir->second + "/" + ev->name);
+	}
+      }
+
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+  }
+
+  return (NULL);
+}
+
+
+/*
+ * a private copy of a small file, NULL if it changed size under us or the
+ * buffer budget is spent
+ */
+static uint8_t *load_file(const int fd, const size_t size)
+{
+  uint8_t *data;
+  size_t done = 0;
+  ssize_t got;
+
+  if (__sync_add_and_fetch(&buffered_bytes, size) > STATIC_BUFFER_BUDGET) {
+    __sync_fetch_and_sub(&buffered_bytes, size);
+    return (NULL);
+  }
+
+  if ((data = (uint8_t *)malloc(size)) != NULL) {
+    while (done < size) {
+      if ((got = pread(fd, data + done, size - done, done)) <= 0) {
+	if ((got < 0) && (errno == EINTR)) {
+	  continue;
+	}
+	break;
+      }
+      done += got;
+    }
+
+    if (done == size) {
+      return (data);
+    }
+    free(data);
+  }
+
+  __sync_fetch_and_sub(&buffered_bytes, size);
+  return (NULL);
+}
+
+
+/*
+ * returns a referenced entry for path, opening and caching it on a miss.
+ * misses are cached too so variant probing costs no syscalls once warm.
+ */
+static file_entry_st *cache_lookup(const std::string &path)
+{
+  std::map<std::string, file_entry_st *>::iterator it;
+  file_entry_st *entry;
+
+  pthread_rwlock_rdlock(&cache_lock);
+  if ((it = file_cache.find(path)) != file_cache.end()) {
+    entry = it->second;
+    __sync_add_and_fetch(&entry->refs, 1);
+    if (!entry->referenced) {
+      entry->referenced = true;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+    return (entry);
+  }
+  pthread_rwlock_unlock(&cache_lock);
+
+  entry = new file_entry_st;
+  entry->data = NULL;
+  entry->refs = 2; // one for the cache, one for the caller
+  entry->referenced = false;
+  entry->etag[0] = '\0';
+
+  if ((entry->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+    if ((fstat(entry->fd, &entry->st) < 0) || (!S_ISREG(entry->st.st_mode))) {
+      close(entry->fd);
+      entry->fd = -1;
+    }
+  }
+
+  if (entry->fd != -1) {
+    snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx-%lx\"", 
+	     (unsigned long)entry->st.st_ino, (unsigned long)entry->st.st_size, 
+	     (unsigned long)entry->st.st_mtime);
+
+    if ((entry->st.st_size > 0) && (entry->st.st_size <= STATIC_BUFFER_MAX)) {
+      entry->data = load_file(entry->fd, entry->st.st_size);
+    }
+  }
+
+  pthread_rwlock_wrlock(&cache_lock);
+  if ((it = file_cache.find(path)) != file_cache.end()) {
+    // lost the race, use the entry that is already cached
+    __sync_add_and_fetch(&it->second->refs, 1);
+    entry->refs = 1;
+    entry_release(entry);
+    entry = it->second;
+  } else if (watch_dir(path)) {
+    cache_evict();
+    entry->order = cache_order.insert(cache_order.end(), path);
+    file_cache[path] = entry;
+  } else {
+    // served once, uncached
+    entry->refs = 1;
+  }
+  pthread_rwlock_unlock(&cache_lock);
+
+  return (entry);
+}
+
+
+static std::string header_value(const char *headers, const char *name)
+{
+  size_t name_len = strlen(name);
+  const char *line = headers;
+
+  while ((line = strstr(line, "\n")) != NULL) {
+    ++line;
+    if ((strncasecmp(line, name, name_len) == 0) && (line[name_len] == ':')) {
+      const char *start = line + name_len + 1;
+      const char *end = strpbrk(start, "\r\n");
+
+      while (*start == ' ') {
+	++start;
+      }
+      return (std::string(start, end ? end - start : strlen(start)));
+    }
+  }
+
+  return (std::string());
+}
+
+
+static int hex_value(const char c)
+{
+  if ((c >= '0') && (c <= '9')) {
+    return (c - '0');
+  } else if ((c >= 'a') && (c <= 'f')) {
+    return (c - 'a' + 10);
+  } else if ((c >= 'A') && (c <= 'F')) {
+    return (c - 'A' + 10);
+  }
+  return (-1);
+}
+
+
+static bool parse_request(char *buffer, request_st &req)
+{
+  char *method = buffer;
+  char *uri;
+  char *end;
+  std::string path;
+
+  if ((uri = strchr(method, ' ')) == NULL) {
+    return (false);
+  }
+  *uri++ = '\0';
+
+  if ((end = strpbrk(uri, " ?\r\n")) == NULL) {
+    return (false);
+  }
+
+  if (strcmp(method, "HEAD") == 0) {
+    req.head = true;
+  } else if (strcmp(method, "GET") == 0) {
+    req.head = false;
+  } else {
+    return (false);
+  }
+
+  for (char *p = uri; p < end; ++p) {
+    if ((*p == '%') && (p + 2 < end) && (hex_value(p[1]) >= 0) && (hex_value(p[2]) >= 0)) {
+      path += (char)((hex_value(p[1]) << 4) | hex_value(p[2]));
+      p += 2;
+    } else {
+      path += *p;
+    }
+  }
+
+  if ((path.empty()) || (path[0] != '/') || (path.find('\0') != std::string::npos) ||
+      (path.find("/../") != std::string::npos) || 
+      ((path.size() >= 3) && (path.compare(path.size() - 3, 3, "/..") == 0))) {
+    return (false);
+  }
+
+  if (path[path.size() - 1] == '/') {
+    path += "index.html";
+  }
+
+  req.path = doc_root + path;
+  req.if_none_match = header_value(end, "If-None-Match");
+  req.range = header_value(end, "Range");
+  req.accept_encoding = header_value(end, "Accept-Encoding");
+
+  return (true);
+}
+
+
+static bool etag_matches(const std::string &list, const char *etag)
+{
+  if (list.empty()) {
+    return (false);
+  }
+
+  if (list.find('*') != std::string::npos) {
+    return (true);
+  }
+
+  return (list.find(etag) != std::string::npos);
+}
+
+
+/*
+ * parses a single "bytes=" range against size. returns 1 for a valid
+ * range, 0 to ignore the header (malformed or several ranges) and -1
+ * if it is well formed but cannot be satisfied.
+ */
+static int parse_range(const std::string &range, const off_t size, off_t &start, off_t &len)
+{
+  const char *spec;
+  char *end;
+  long long first;
+  long long last;
+
+  if ((range.compare(0, 6, "bytes=") != 0) || (range.find(',') != std::string::npos)) {
+    return (0);
+  }
+
+  spec = range.c_str() + 6;
+
+  // strtoll would also take signs and spaces
+  if (*spec == '-') {
+    if (!isdigit((unsigned char)spec[1])) {
+      return (0);
+    }
+    last = strtoll(spec + 1, &end, 10);
+    if (*end != '\0') {
+      return (0);
+    }
+    if ((last <= 0) || (size == 0)) {
+      return (-1);
+    }
+    start = (last >= size) ? 0 : size - last;
+    len = size - start;
+    return (1);
+  }
+
+  if (!isdigit((unsigned char)*spec)) {
+    return (0);
+  }
+
+  first = strtoll(spec, &end, 10);
+  if (*end != '-') {
+    return (0);
+  }
+
+  spec = end + 1;
+  last = size - 1;
+  if (*spec) {
+    if (!isdigit((unsigned char)*spec)) {
+      return (0);
+    }
+    last = strtoll(spec, &end, 10);
+    if ((*end != '\0') || (last < first)) {
+      return (0);
+    }
+  }
+
+  if (first >= size) {
+    return (-1);
+  }
+
+  if (last >= size) {
+    last = size - 1;
+  }
+
+  start = first;
+  len = last - first + 1;
+  return (1);
+}
+
+
+static void send_status(int fd, const char *status)
+{
+  char header[STATIC_HDR_MAX];
+  int len;
+
+  len = snprintf(header, sizeof(header), 
+		 "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+  swiss_write(fd, (const uint8_t *)header, len);
+}
+
+
+static void serve(int fd, request_st &req)
+{
+  file_entry_st *entry = NULL;
+  const char *encoding = NULL;
+  swiss_buf_st *packed = NULL;
+  char header[STATIC_HDR_MAX];
+  char etag[sizeof(entry->etag) + 16];
+  off_t start = 0;
+  off_t len;
+  int hlen;
+  int range = 0;
+  int coding = SWISS_COMPRESS_NONE;
+
+  /*
+   * prefer a precompressed sibling the client accepts, misses are
+   * cached. ranges are always served from the identity encoding.
+   */
+  for (int i = 0; (req.range.empty()) && (encodings[i].token); ++i) {
+    if (swiss_compress_accepts(req.accept_encoding.c_str(), encodings[i].token)) {
+      entry = cache_lookup(req.path + encodings[i].suffix);
+      if (entry->fd != -1) {
+	encoding = encodings[i].token;
+	break;
+      }
+      entry_release(entry);
+      entry = NULL;
+    }
+  }
+
+  if (!entry) {
+    entry = cache_lookup(req.path);
+  }
+
+  if (entry->fd == -1) {
+    send_status(fd, "404 Not Found");
+    entry_release(entry);
+    return;
+  }
+
+  if ((!encoding) && (entry->data) && (req.range.empty()) && (compressible(mime_type(req.path)))) {
+    coding = swiss_compress_negotiate(req.accept_encoding.c_str());
+  }
+
+  /*
+   * compressed once per content and level, NULL if it doesn't shrink.
+   * done before the conditional check, which has to compare the tag of
+   * the representation a 200 would actually send
+   */
+  if (coding != SWISS_COMPRESS_NONE) {
+    packed = swiss_compress_buf(compress_cache, coding, STATIC_COMPRESS_LEVEL, 
+				entry->data, entry->st.st_size);
+  }
+
+  // each encoding of the file is a separate representation with its own tag
+  snprintf(etag, sizeof(etag), "%s", entry->etag);
+  if (packed) {
+    encoding = swiss_compress_name(coding);
+    snprintf(etag, sizeof(etag), "%.*s-%s\"", (int)strlen(entry->etag) - 1, entry->etag, encoding);
+  }
+
+  if (etag_matches(req.if_none_match, etag)) {
+    hlen = snprintf(header, sizeof(header), 
+		    "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: close\r\n\r\n", etag);
+    swiss_write(fd, (const uint8_t *)header, hlen);
+    swiss_buf_release(packed);
+    entry_release(entry);
+    return;
+  }
+
+  len = packed ? (off_t)packed->len : entry->st.st_size;
+  if ((!req.range.empty()) && ((range = parse_range(req.range, entry->st.st_size, start, len)) < 0)) {
+    hlen = snprintf(header, sizeof(header), 
+		    "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+		    "Content-Length: 0\r\nConnection: close\r\n\r\n", (long long)entry->st.st_size);
+    swiss_write(fd, (const uint8_t *)header, hlen);
+    entry_release(entry);
+    return;
+  }
+
+  hlen = snprintf(header, sizeof(header), 
+		  "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\nETag: %s\r\n"
+		  "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\nConnection: close\r\n",
+		  range ? "206 Partial Content" : "200 OK", mime_type(req.path), 
+		  (long long)len, etag);
+
+  if (encoding) {
+    hlen += snprintf(header + hlen, sizeof(header) - hlen, "Content-Encoding: %s\r\n", encoding);
+  }
+
+  if (range) {
+    hlen += snprintf(header + hlen, sizeof(header) - hlen, "Content-Range: bytes %lld-%lld/%lld\r\n",
+		     (long long)start, (long long)(start + len - 1), (long long)entry->st.st_size);
+  }
+
+  hlen += snprintf(header + hlen, sizeof(header) - hlen, "\r\n");
+
+  if ((req.head) || (len == 0)) {
+    swiss_write(fd, (const uint8_t *)header, hlen);
+  } else if (packed) {
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = packed->data;
+    iov[1].iov_len = len;
+    swiss_writev(fd, iov, 2);
+  } else if (entry->data) {
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = entry->data + start;
+    iov[1].iov_len = len;
+    swiss_writev(fd, iov, 2);
+  } else {
+    // hold the headers back so they leave in the same segment as the body
+    if (swiss_send(fd, (const uint8_t *)header, hlen, MSG_MORE) > 0) {
+      swiss_sendfile(fd, entry->fd, &start, len);
+    }
+  }
+
+  swiss_buf_release(packed);
+  entry_release(entry);
+}
+
+
+extern "C" int load()
+{
+  const char *root = getenv("SWISS_STATIC_ROOT");
+  const char *port = getenv("SWISS_STATIC_PORT");
+  char resolved[PATH_MAX];
+
+  if (!realpath(root ? root : STATIC_DEFAULT_ROOT, resolved)) {
+    std::cout << "static_files: document root does not exist" << std::endl;
+    return (-1);
+  }
+  doc_root = resolved;
+
+  if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+    return (-1);
+  }
+
+  compress_cache = swiss_cache_create(STATIC_COMPRESS_SHARDS, STATIC_COMPRESS_BUDGET);
+
+  if ((pipe(stop_pipe) < 0) || (pthread_create(&watch_thread, NULL, watchEntry, NULL) != 0)) {
+    close(inotify_fd);
+    return (-1);
+  }
+
+  return (port ? atoi(port) : STATIC_DEFAULT_PORT);
+}
+
+extern "C" void work(void *data)
+{
+  swiss_work_st *work;
+  char buffer[STATIC_REQ_MAX];
+  int total = 0;
+  int read;
+  request_st req;
+
+  if (!data) {
+    return;
+  }
+
+  work = (swiss_work_st *)data;
+
+  // read until the end of the request headers
+  while (total < STATIC_REQ_MAX - 1) {
+    if ((read = swiss_read(work->fd, (uint8_t *)buffer + total, STATIC_REQ_MAX - 1 - total)) <= 0) {
+      break;
+    }
+    total += read;
+    buffer[total] = '\0';
+    if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) {
+      break;
+    }
+  }
+
+  if (total > 0) {
+    buffer[total] = '\0';
+    if (parse_request(buffer, req)) {
+      serve(work->fd, req);
+    } else {
+      send_status(work->fd, "400 Bad Request");
+    }
+  }
+
+  swiss_close(&work->fd);
+
+  delete work;
+}
+
+extern "C" int unload()
+{
+  if (stop_pipe[1] != -1) {
+    if (write(stop_pipe[1], "", 1) == 1) {
+      pthread_join(watch_thread, NULL);
+    }
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+  }
+
+  pthread_rwlock_wrlock(&cache_lock);
+  cache_flush();
+  pthread_rwlock_unlock(&cache_lock);
+
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+  }
+
+  if (compress_cache) {
+    swiss_cache_destroy(compress_cache);
+    compress_cache = NULL;
+  }
+
+  return (0);
+}
@@ -0,0 +1,350 @@
+/*
+ * profiler.hpp
+ *
+ *
+ * Swiss Sampling Profiler
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __PROFILER__
+#define __PROFILER__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <cxxabi.h>
+
+#define PROFILE_HZ 99
+#define PROFILE_DEPTH 48
+// samples kept per capture, later ones are counted as dropped
+#define PROFILE_SAMPLES 16384
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+typedef struct profile_sample_st {
+  volatile uint32_t depth;   // 0 until the sample is complete
+  void             *pcs[PROFILE_DEPTH];
+} profile_sample_st;
+
+
+/*
+ * In process sampling profiler. start() arms a CPU time timer on every
+ * thread in the process (pool workers, acceptors, module threads) that
+ * delivers SIGPROF to that thread alone, so threads are sampled in
+ * proportion to the CPU they use. The handler walks the frame pointer
+ * chain of the interrupted code into a slot it claims with an atomic
+ * increment; it takes no locks and never touches the loader, so it is
+ * safe wherever the thread was stopped. Code built without frame
+ * pointers (libc, optimised modules without -fno-omit-frame-pointer)
+ * cuts the stack short. Nothing is armed between captures, so the
+ * profiler costs nothing when off.
+ *
+ * Threads started during a capture are not sampled. Addresses resolve
+ * through dladdr against the binary (linked -rdynamic) and the loaded
+ * modules; functions missing from the dynamic symbol table show up as
+ * module+offset.
+ */
+class Profiler {
+
+public:
+  static bool start()
+  {
+    struct sigaction sa;
+    struct dirent *entry;
+    DIR *dir;
+
+    if (samples_) {
+      return (false);
+    }
+
+    samples_ = new profile_sample_st[PROFILE_SAMPLES];
+    memset(samples_, 0, sizeof(profile_sample_st) * PROFILE_SAMPLES);
+    count_ = 0;
+    dropped_ = 0;
+    __atomic_store_n(&live_, samples_, __ATOMIC_SEQ_CST);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = &sample;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+
+    if ((dir = opendir("/proc/self/task")) == NULL) {
+      return (true);
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+	arm(atoi(entry->d_name));
+      }
+    }
+    closedir(dir);
+
+    return (true);
+  }
+
+  static void stop()
+  {
+    struct sigaction sa;
+
+    for (unsigned int i = 0; i < timers_.size(); ++i) {
+      timer_delete(timers_[i]);
+    }
+    timers_.clear();
+
+    // a signal still pending from a deleted timer is dropped
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPROF, &sa, NULL);
+
+    // a handler already under way on another thread finishes before write() frees the capture
+    __atomic_store_n(&live_, (profile_sample_st *)NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&active_, __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+
+  /*
+   * one line per distinct stack, outermost frame first, followed by the
+   * number of samples (the input flamegraph.pl expects). frees the
+   * capture, stopping it first if need be.
+   */
+  static void write(std::ostream &out)
+  {
+    std::map<void *, std::string> symbols;
+    std::map<std::string, uint32_t> stacks;
+    uint32_t count;
+
+    if (!samples_) {
+      return;
+    }
+
+    if (__atomic_load_n(&live_, __ATOMIC_SEQ_CST)) {
+      stop();
+    }
+
+    count = (count_ < PROFILE_SAMPLES) ? count_ : PROFILE_SAMPLES;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      profile_sample_st *s = &samples_[i];
+      std::string stack;
+
+      for (int f = (int)s->depth - 1; f >= 0; --f) {
+	std::map<void *, std::string>::iterator it = symbols.find(s->pcs[f]);
+
+	if (it == symbols.end()) {
+	  it = symbols.insert(std::make_pair(s->pcs[f], symbolize(s->pcs[f], f > 0))).first;
+	}
+	if (!stack.empty()) {
+	  stack += ';';
+	}
+	stack += it->second;
+      }
+
+      if (!stack.empty()) {
+	++stacks[stack];
+      }
+    }
+
+    for (std::map<std::string, uint32_t>::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+      out << it->first << " " << it->second << "\n";
+    }
+    out.flush();
+
+    if (dropped_) {
+      std::cout << "Profiler: " << dropped_ << " samples dropped" << std::endl;
+    }
+
+    delete [] samples_;
+    samples_ = NULL;
+  }
+
+private:
+  static void arm(pid_t tid)
+  {
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+    // the kernel's per thread CPU clock, as pthread_getcpuclockid builds it
+    clockid_t clock = ((~(clockid_t)tid) << 3) | 6;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = tid;
+
+    if (timer_create(clock, &sev, &timer) < 0) {
+      return;
+    }
+
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000 / PROFILE_HZ;
+    its.it_value = its.it_interval;
+
+    if (timer_settime(timer, 0, &its, NULL) < 0) {
+      timer_delete(timer);
+      return;
+    }
+
+    timers_.push_back(timer);
+  }
+
+  static void sample(int, siginfo_t *, void *context)
+  {
+    int saved = errno;
+    profile_sample_st *samples;
+    uint32_t slot;
+
+    // pairs with stop(): either it waits for us or we see the capture gone
+    __atomic_fetch_add(&active_, 1, __ATOMIC_SEQ_CST);
+
+    if ((samples = __atomic_load_n(&live_, __ATOMIC_SEQ_CST)) != NULL) {
+      if ((slot = __sync_fetch_and_add(&count_, 1)) < PROFILE_SAMPLES) {
+	samples[slot].depth = unwind(static_cast<ucontext_t *>(context), samples[slot].pcs);
+      } else {
+	__sync_fetch_and_add(&dropped_, 1);
+      }
+    }
+
+    __atomic_fetch_sub(&active_, 1, __ATOMIC_SEQ_CST);
+    errno = saved;
+  }
+
+  /*
+   * the interrupted pc, then the return address of every frame on the
+   * frame pointer chain. frames are copied in with process_vm_readv so
+   * a chain broken by code without frame pointers ends the walk rather
+   * than faulting in the handler.
+   */
+  static uint32_t unwind(const ucontext_t *uc, void **pcs)
+  {
+    struct iovec local;
+    struct iovec remote;
+    uintptr_t frame[2];   // saved frame pointer, return address
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+    pid_t pid = getpid();
+    uint32_t depth = 0;
+
+    pcs[depth++] = (void *)uc->uc_mcontext.gregs[REG_RIP];
+
+    while ((depth < PROFILE_DEPTH) && (fp) && (!(fp & (sizeof(uintptr_t) - 1)))) {
+      local.iov_base = frame;
+      local.iov_len = sizeof(frame);
+      remote.iov_base = (void *)fp;
+      remote.iov_len = sizeof(frame);
+
+      if ((process_vm_readv(pid, &local, 1, &remote, 1, 0) != sizeof(frame)) || (!frame[1])) {
+	break;
+      }
+      pcs[depth++] = (void *)frame[1];
+
+      // the stack grows down, a caller's frame is always above ours
+      if (frame[0] <= fp) {
+	break;
+      }
+      fp = frame[0];
+    }
+
+    return (depth);
+  }
+
+  // return addresses point past the call, look up the call itself
+  static std::string symbolize(void *pc, bool caller)
+  {
+    Dl_info info;
+    char buffer[256];
+    void *addr = (uint8_t *)pc - (caller ? 1 : 0);
+
+    if ((!dladdr(addr, &info)) || (!info.dli_fname)) {
+      snprintf(buffer, sizeof(buffer), "[%p]", pc);
+      return (buffer);
+    }
+
+    if (info.dli_sname) {
+      int status;
+      char *name = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+      std::string symbol(status == 0 ? name : info.dli_sname);
+
+      free(name);
+      return (symbol);
+    }
+
+    const char *module = strrchr(info.dli_fname, '/');
+    snprintf(buffer, sizeof(buffer), "%s+0x%lx", module ? module + 1 : info.dli_fname, 
+	     (unsigned long)((uint8_t *)addr - (uint8_t *)info.dli_fbase));
+    return (buffer);
+  }
+
+  static profile_sample_st *samples_;
+  static profile_sample_st *live_;     // what the handler writes to, NULL once stopped
+  static uint32_t active_;             // handlers running right now
+  static volatile uint32_t count_;
+  static volatile uint32_t dropped_;
+  static std::vector<timer_t> timers_;
+};
+
+profile_sample_st *Profiler::samples_ = NULL;
+profile_sample_st *Profiler::live_ = NULL;
+uint32_t Profiler::active_ = 0;
+volatile uint32_t Profiler::count_ = 0;
+volatile uint32_t Profiler::dropped_ = 0;
+std::vector<timer_t> Profiler::timers_;
+
+
+#endif
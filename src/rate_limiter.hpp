@@ -0,0 +1,215 @@
+/*
+ * rate_limiter.hpp
+ *
+ *
+ * Swiss Per-Client Rate Limiter
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __RATE_LIMITER__
+#define __RATE_LIMITER__
+
+#include <cstring>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// slots per set, a client maps to exactly one set
+#define LIMIT_WAYS 8
+// token counts are kept in thousandths of a connection
+#define LIMIT_SCALE 1000
+
+
+enum {
+  LIMIT_ADMIT = 0,
+  LIMIT_RATE,
+  LIMIT_CONNS
+};
+
+typedef struct limit_slot_st {
+  uint32_t          key;         // masked client address
+  uint32_t          used;
+  volatile uint32_t conns;
+  uint64_t          tokens;
+  uint64_t          refill;
+  uint64_t          last_seen;
+} limit_slot_st;
+
+
+/*
+ * Fixed size, set associative table of token buckets and connection
+ * counts keyed by client address or subnet. admit() is only called by
+ * the server's acceptor thread, so the table needs no lock; workers only
+ * touch the slot they were handed, with an atomic decrement in
+ * release(). Clients are evicted least recently seen first within their
+ * set, but never while they still have connections open, which bounds
+ * memory no matter how many addresses connect.
+ */
+class RateLimiter {
+
+public:
+  RateLimiter(uint32_t entries, uint32_t rate, uint32_t burst, uint32_t max_conns, uint32_t prefix) :
+    sets_((entries + LIMIT_WAYS - 1) / LIMIT_WAYS),
+    rate_(rate),
+    burst_((uint64_t)(burst ? burst : (rate ? rate : 1)) * LIMIT_SCALE),
+    max_conns_(max_conns),
+    mask_(prefix >= 32 ? 0xffffffff : (prefix ? ~(0xffffffff >> prefix) : 0))
+  {
+    // time for an empty bucket to fill up again
+    full_ns_ = rate_ ? burst_ * 1000000000ULL / (rate_ * LIMIT_SCALE) + 1 : 0;
+    if (!sets_) {
+      sets_ = 1;
+    }
+    slots_ = new limit_slot_st[sets_ * LIMIT_WAYS];
+    memset(slots_, 0, sizeof(limit_slot_st) * sets_ * LIMIT_WAYS);
+  }
+
+  ~RateLimiter()
+  {
+    delete [] slots_;
+  }
+
+  /*
+   * returns LIMIT_ADMIT and the slot to release once the connection is
+   * done (NULL if the set was full of active clients and it is not
+   * tracked), or the reason the connection should be turned away
+   */
+  int admit(const struct sockaddr_in &addr, const uint64_t now, limit_slot_st **slot)
+  {
+    uint32_t key = ntohl(addr.sin_addr.s_addr) & mask_;
+    limit_slot_st *set = &slots_[(hash(key) % sets_) * LIMIT_WAYS];
+    limit_slot_st *s = NULL;
+    limit_slot_st *victim = NULL;
+
+    *slot = NULL;
+
+    for (uint32_t i = 0; i < LIMIT_WAYS; ++i) {
+      if ((set[i].used) && (set[i].key == key)) {
+	s = &set[i];
+	break;
+      }
+
+      // prefer an unused slot, then the least recently seen idle one
+      if ((set[i].conns == 0) && 
+	  ((!victim) || ((victim->used) && ((!set[i].used) || (set[i].last_seen < victim->last_seen))))) {
+	victim = &set[i];
+      }
+    }
+
+    if (!s) {
+      if (!victim) {
+	// every client in the set has connections open, let it through untracked
+	return (LIMIT_ADMIT);
+      }
+
+      s = victim;
+      s->used = 1;
+      s->key = key;
+      s->tokens = burst_;
+      s->refill = now;
+    }
+
+    s->last_seen = now;
+
+    if (rate_) {
+      uint64_t elapsed = now - s->refill;
+      uint64_t added;
+
+      if (elapsed >= full_ns_) {
+	s->tokens = burst_;
+	s->refill = now;
+      } else if ((added = elapsed * rate_ * LIMIT_SCALE / 1000000000ULL) > 0) {
+	// only move the refill point when something was added, so frequent
+	// accepts don't round the refill away
+	s->tokens = (s->tokens + added > burst_) ? burst_ : s->tokens + added;
+	s->refill = now;
+      }
+
+      if (s->tokens < LIMIT_SCALE) {
+	return (LIMIT_RATE);
+      }
+    }
+
+    if ((max_conns_) && (s->conns >= max_conns_)) {
+      return (LIMIT_CONNS);
+    }
+
+    s->tokens -= rate_ ? LIMIT_SCALE : 0;
+    __sync_fetch_and_add(&s->conns, 1);
+    *slot = s;
+
+    return (LIMIT_ADMIT);
+  }
+
+  static void release(limit_slot_st *slot)
+  {
+    if (slot) {
+      __sync_fetch_and_sub(&slot->conns, 1);
+    }
+  }
+
+private:
+  RateLimiter(const RateLimiter &);
+  RateLimiter &operator=(const RateLimiter &);
+
+  static uint32_t hash(uint32_t key)
+  {
+    key ^= key >> 16;
+    key *= 0x7feb352d;
+    key ^= key >> 15;
+    key *= 0x846ca68b;
+    key ^= key >> 16;
+    return (key);
+  }
+
+  limit_slot_st *slots_;
+  uint32_t sets_;
+  uint32_t rate_;
+  uint64_t burst_;
+  uint64_t full_ns_;
+  uint32_t max_conns_;
+  uint32_t mask_;
+};
+
+
+#endif
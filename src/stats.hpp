@@ -0,0 +1,94 @@
+/*
+ * stats.hpp
+ *
+ *
+ * Swiss Shared Statistics
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_STATS__
+#define __SWISS_STATS__
+
+#include <iostream>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "thread_pool/thread_pool.hpp"
+
+#define STATS_MAX_WORKERS 64
+#define STATS_MAGIC       0x53575353
+
+
+/*
+ * Per worker process counters. In prefork mode these live in a shared
+ * memory region (/dev/shm/swiss.<supervisor pid>) so the supervisor and
+ * outside tools can read them while the workers update them.
+ */
+typedef struct worker_stats_st {
+  volatile pid_t pid;
+  int32_t        node;
+  uint32_t       restarts;
+  int32_t        last_status;
+  uint64_t       started;
+  uint64_t       accepted;
+  uint64_t       rejected;
+  pool_metrics_st pool;         // summed over every server in the process
+} __attribute__((aligned(64))) worker_stats_st;
+
+typedef struct swiss_stats_st {
+  uint32_t        magic;
+  uint32_t        workers;
+  worker_stats_st worker[STATS_MAX_WORKERS];
+} swiss_stats_st;
+
+
+static inline void dumpWorkerStats(std::ostream &out, const worker_stats_st &ws)
+{
+  out << "pid " << ws.pid << " node " << ws.node << " restarts " << ws.restarts 
+      << " accepted " << ws.accepted << " rejected " << ws.rejected 
+      << " threads " << ws.pool.threads << " idle " << ws.pool.idle 
+      << " grown " << ws.pool.grown << " retired " << ws.pool.retired 
+      << " queue_delay_us " << ws.pool.queue_delay_ns / 1000 << std::endl;
+}
+
+
+#endif
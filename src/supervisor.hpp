@@ -0,0 +1,342 @@
+/*
+ * supervisor.hpp
+ *
+ *
+ * Swiss Prefork Supervisor
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SWISS_SUPERVISOR__
+#define __SWISS_SUPERVISOR__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stats.hpp"
+
+// a worker that dies sooner than this after starting is restarted with a delay
+#define RESTART_BACKOFF_S 1
+
+
+/*
+ * Forks a fixed number of worker processes and keeps them running. Each
+ * worker opens its own SO_REUSEPORT listeners, so the kernel spreads
+ * connections across them and a crash only takes down one worker.
+ */
+class Supervisor {
+
+public:
+  Supervisor(uint32_t workers, bool numa, int (*w)(worker_stats_st *, void *), void *opaque) : 
+    workers_(workers > STATS_MAX_WORKERS ? STATS_MAX_WORKERS : workers), 
+    numa_(numa), 
+    worker_fp_(w), 
+    opaque_(opaque), 
+    stats_(NULL)
+  {
+    snprintf(shm_name_, sizeof(shm_name_), "/swiss.%d", getpid());
+  }
+
+  ~Supervisor()
+  {
+    if (stats_) {
+      munmap(stats_, sizeof(swiss_stats_st));
+      shm_unlink(shm_name_);
+    }
+  }
+
+  int run()
+  {
+    struct sigaction sa;
+
+    mapStats();
+
+    if (numa_) {
+      loadNodes();
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &signalHandler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    for (uint32_t i = 0; i < workers_; ++i) {
+      spawn(i);
+    }
+
+    while (!stopping()) {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+
+      if (dumpRequested()) {
+	dump();
+	signalWorkers(SIGUSR1);
+      }
+
+      if (profile_) {
+	profile_ = 0;
+	signalWorkers(SIGUSR2);
+      }
+
+      if (pid <= 0) {
+	continue;
+      }
+
+      for (uint32_t i = 0; i < workers_; ++i) {
+	if (stats_->worker[i].pid == pid) {
+	  respawn(i, status);
+	  break;
+	}
+      }
+    }
+
+    shutdown();
+    return (EXIT_SUCCESS);
+  }
+
+private:
+
+  void mapStats()
+  {
+    int fd;
+
+    if (((fd = shm_open(shm_name_, O_CREAT | O_RDWR, 0644)) < 0) || 
+	(ftruncate(fd, sizeof(swiss_stats_st)) < 0)) {
+      throw "unable to create shared stats region";
+    }
+
+    stats_ = (swiss_stats_st *)mmap(NULL, sizeof(swiss_stats_st), PROT_READ | PROT_WRITE, 
+				    MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (stats_ == MAP_FAILED) {
+      stats_ = NULL;
+      shm_unlink(shm_name_);
+      throw "unable to map shared stats region";
+    }
+
+    memset(stats_, 0, sizeof(swiss_stats_st));
+    stats_->magic = STATS_MAGIC;
+    stats_->workers = workers_;
+  }
+
+  // reads the cpu list of every NUMA node
+  void loadNodes()
+  {
+    for (int node = 0; ; ++node) {
+      char path[128];
+      char list[4096];
+      std::vector<int> cpus;
+      FILE *fp;
+
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      if ((fp = fopen(path, "r")) == NULL) {
+	break;
+      }
+
+      if (fgets(list, sizeof(list), fp)) {
+	ThreadPool::parseCpuList(list, cpus);
+      }
+      fclose(fp);
+
+      if (!cpus.empty()) {
+	nodes_.push_back(cpus);
+      }
+    }
+  }
+
+  void pin(uint32_t i)
+  {
+    cpu_set_t set;
+    int node = i % nodes_.size();
+
+    CPU_ZERO(&set);
+    for (unsigned int c = 0; c < nodes_[node].size(); ++c) {
+      CPU_SET(nodes_[node][c], &set);
+    }
+
+    // threads and first-touch allocations in the worker inherit this
+    if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+      stats_->worker[i].node = node;
+    }
+  }
+
+  void spawn(uint32_t i)
+  {
+    worker_stats_st *ws = &stats_->worker[i];
+    pid_t pid;
+
+    ws->node = -1;
+    ws->started = time(NULL);
+    ws->accepted = 0;
+    ws->rejected = 0;
+    memset(&ws->pool, 0, sizeof(ws->pool));
+
+    if ((pid = fork()) < 0) {
+      std::cout << "Supervisor: fork failed for worker " << i << std::endl;
+      ws->pid = 0;
+      return;
+    }
+
+    if (pid == 0) {
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      // until the worker installs its own handlers
+      signal(SIGUSR1, SIG_IGN);
+      signal(SIGUSR2, SIG_IGN);
+
+      ws->pid = getpid();
+      if (!nodes_.empty()) {
+	pin(i);
+      }
+      _exit(worker_fp_(ws, opaque_));
+    }
+
+    ws->pid = pid;
+  }
+
+  void respawn(uint32_t i, int status)
+  {
+    worker_stats_st *ws = &stats_->worker[i];
+
+    ws->last_status = status;
+    ws->pid = 0;
+
+    if (WIFSIGNALED(status)) {
+      std::cout << "Supervisor: worker " << i << " killed by signal " << WTERMSIG(status) << std::endl;
+    } else {
+      std::cout << "Supervisor: worker " << i << " exited with " << WEXITSTATUS(status) << std::endl;
+    }
+
+    // don't spin if a worker dies straight away, e.g. on a bad module
+    if (time(NULL) - (time_t)ws->started < RESTART_BACKOFF_S) {
+      sleep(RESTART_BACKOFF_S);
+    }
+
+    if (!stopping()) {
+      ++ws->restarts;
+      spawn(i);
+    }
+  }
+
+  void signalWorkers(int sig)
+  {
+    for (uint32_t i = 0; i < workers_; ++i) {
+      if (stats_->worker[i].pid > 0) {
+	kill(stats_->worker[i].pid, sig);
+      }
+    }
+  }
+
+  void shutdown()
+  {
+    signalWorkers(SIGTERM);
+
+    while ((waitpid(-1, NULL, 0) > 0) || (errno == EINTR)) {
+      ;
+    }
+  }
+
+  void dump()
+  {
+    for (uint32_t i = 0; i < workers_; ++i) {
+      std::cout << "worker " << i << " ";
+      dumpWorkerStats(std::cout, stats_->worker[i]);
+    }
+  }
+
+  static void signalHandler(int sig)
+  {
+    if (sig == SIGUSR1) {
+      dump_ = 1;
+    } else if (sig == SIGUSR2) {
+      profile_ = 1;
+    } else {
+      stop_ = 1;
+    }
+  }
+
+  static bool stopping()
+  {
+    return (stop_);
+  }
+
+  static bool dumpRequested()
+  {
+    bool requested = dump_;
+
+    dump_ = 0;
+    return (requested);
+  }
+
+  static volatile sig_atomic_t stop_;
+  static volatile sig_atomic_t dump_;
+  static volatile sig_atomic_t profile_;
+
+  uint32_t workers_;
+  bool numa_;
+  int (*worker_fp_)(worker_stats_st *stats, void *opaque);
+  void *opaque_;
+  swiss_stats_st *stats_;
+  char shm_name_[64];
+  std::vector<std::vector<int> > nodes_;
+};
+
+volatile sig_atomic_t Supervisor::stop_ = 0;
+volatile sig_atomic_t Supervisor::dump_ = 0;
+volatile sig_atomic_t Supervisor::profile_ = 0;
+
+
+#endif
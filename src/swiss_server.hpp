@@ -51,27 +51,98 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <deque>
+#include <utility>
+#include <vector>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 #include "thread_pool/thread_pool.hpp"
 #include "include/module.h"
+#include "stats.hpp"
+#include "rate_limiter.hpp"
+#include "arena.hpp"
+#include "capture.hpp"
+#include "timing.hpp"
+#include "include/swiss_trace.h"
 
 #define LISTEN_Q_SIZE 1024
+#define SERVER_THREADS 4
+#define LIMIT_ENTRIES 16384
+// most rejected connections held open at once, and how often they are swept
+#define TARPIT_MAX 1024
+#define TARPIT_SWEEP_MS 100
+// low latency listener tuning
+#define BUSY_POLL_US 50
+#define DEFER_ACCEPT_S 1
+#define FASTOPEN_Q_SIZE 256
+// most connections handed to a module's work_batch in one call
+#define BATCH_MAX 32
+// most bytes a traffic capture file may grow to, allocated up front per port and worker
+#define CAPTURE_LIMIT (64ULL * 1024 * 1024)
+
+
+typedef struct server_config_st {
+  uint32_t         threads;
+  uint32_t         max_threads; // grow the pool up to this under load, 0 for fixed
+  bool             reuse_port;  // set when several processes share the ports
+  worker_stats_st *stats;       // shared counters in prefork mode
+  uint32_t         limit_rate;  // new connections per second per client, 0 for none
+  uint32_t         limit_burst;
+  uint32_t         limit_conns; // open connections per client, 0 for none
+  uint32_t         limit_prefix;  // address bits that identify a client
+  uint32_t         limit_entries;
+  uint32_t         tarpit_ms;   // hold rejected connections instead of resetting them
+  bool             low_latency; // spin instead of sleeping, on spin_cpus if any
+  std::vector<int> spin_cpus;
+  const char      *capture_dir; // record request bytes per module here, NULL for off
+  uint64_t         capture_limit;
+  uint32_t         timing_sample; // time one connection in this many, 0 for none
+
+  server_config_st() : threads(SERVER_THREADS), max_threads(0), reuse_port(false), stats(NULL), 
+		       limit_rate(0), limit_burst(0), limit_conns(0), limit_prefix(32), 
+		       limit_entries(LIMIT_ENTRIES), tarpit_ms(0), low_latency(false), 
+		       capture_dir(NULL), capture_limit(CAPTURE_LIMIT), timing_sample(0) {}
+} server_config_st;
 
 
 class SwissServer {
 
 public:
 
-  SwissServer(unsigned int t, unsigned int port, void (*w)(void *)) : threads_(ThreadPool(t)), 
-								      work_fp_(w),
-								      run_(true)
+  SwissServer(const server_config_st &config, unsigned int port, void (*w)(void *), 
+	      void (*c)(swiss_work_st *) = NULL, 
+	      void (*b)(swiss_work_st **, size_t) = NULL) : threads_(ThreadPool(config.threads)), 
+							    config_(config),
+							    limiter_(NULL),
+							    capture_(NULL),
+							    timing_(NULL),
+							    ops_(NULL),
+							    ops_init_(NULL),
+							    listen_fd_(-1),
+							    work_fp_(w),
+							    classify_fp_(c),
+							    batch_fp_(b),
+							    run_(true)
   {  
+    if (config_.max_threads) {
+      threads_.setElastic(config_.max_threads);
+    }
+    if (config_.stats) {
+      threads_.setMetrics(&config_.stats->pool);
+    }
+    if (config_.low_latency) {
+      threads_.setSpin(config_.spin_cpus);
+    }
+
     bzero(&server_addr_, sizeof(server_addr_));
     server_addr_.sin_family = AF_INET;
     server_addr_.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -81,10 +152,65 @@ public:
   ~SwissServer()
   {
     stop();
+    if (listen_fd_ != -1) {
+      close(listen_fd_);
+    }
+    delete limiter_;
+    delete capture_;
+    delete timing_;
   }
 
+  /*
+   * the listener is bound before start returns so connections queue in
+   * the backlog from the moment the server is reported up
+   */
   void start() 
   { 
+    int one = 1;
+
+    if ((listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+      throw "socket failed on module port";
+    }
+
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (config_.reuse_port) {
+      setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+    if (config_.low_latency) {
+      tuneListener();
+    }
+
+    // batching drains the backlog with accept4 until it would block
+    if ((config_.low_latency) || (batch_fp_)) {
+      fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+    }
+
+    if ((bind(listen_fd_, (struct sockaddr *) &server_addr_, sizeof(server_addr_)) < 0) ||
+	(listen(listen_fd_, LISTEN_Q_SIZE) < 0)) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+      throw "bind failed on module port";
+    }
+
+    if ((config_.limit_rate) || (config_.limit_conns)) {
+      limiter_ = new RateLimiter(config_.limit_entries, config_.limit_rate, config_.limit_burst, 
+				 config_.limit_conns, config_.limit_prefix);
+    }
+
+    if (config_.capture_dir) {
+      capture_ = new Capture(config_.capture_dir, ntohs(server_addr_.sin_port), config_.capture_limit);
+    }
+
+    if (config_.timing_sample) {
+      timing_ = new Timing(ntohs(server_addr_.sin_port), config_.timing_sample);
+    }
+
+    // complete before the module can see it, and before any connection is taken
+    if (ops_) {
+      coreOps(ops_);
+      ops_init_(ops_);
+    }
+
     threads_.start();
     threads_.addWork(&mainThread, this);
   }
@@ -93,46 +219,376 @@ public:
   {
     run_ = false;
     threads_.stop();
+    if (capture_) {
+      capture_->finish();
+    }
+  }
+
+  /*
+   * start() fills in the server's part of ops, leaving fields owned
+   * elsewhere (shared) alone, and hands it to the module through init.
+   * the module must not have seen ops yet, call before start.
+   */
+  void setCoreOps(swiss_core_ops_st *ops, void (*init)(const swiss_core_ops_st *))
+  {
+    ops_ = ops;
+    ops_init_ = init;
+  }
+
+  void dumpTiming(std::ostream &out)
+  {
+    if (timing_) {
+      timing_->dump(out);
+    }
   }
 
 private:
 
+  void coreOps(swiss_core_ops_st *ops)
+  {
+    ops->pool = &threads_;
+    // one pool thread is taken by the acceptor
+    ops->threads = threads_.size() - 1;
+    ops->group_create = &ThreadPool::opsGroupCreate;
+    ops->group_run = &ThreadPool::opsGroupRun;
+    ops->group_wait = &ThreadPool::opsGroupWait;
+    ops->group_destroy = &ThreadPool::opsGroupDestroy;
+    ops->capture = capture_;
+    ops->capture_read = &Capture::opsRead;
+    ops->timing = timing_;
+    ops->timing_find = &Timing::opsFind;
+  }
+
+  typedef struct request_ctx_st {
+    SwissServer     *server;
+    limit_slot_st   *slot;
+    swiss_timing_st *timing;   // NULL unless the connection is sampled
+    uint32_t         conn;     // capture's number for the connection, 0 if not recorded
+    int              fd;
+  } request_ctx_st;
+
+  typedef struct batch_st {
+    SwissServer                 *server;
+    std::vector<swiss_work_st *> works;
+  } batch_st;
+
   void handleRequest(void *data)
   {
-    threads_.addWork(work_fp_, data);
+    swiss_work_st *work = (swiss_work_st *)data;
+    uint64_t deadline = 0;
+
+    if (classify_fp_) {
+      classify_fp_(work);
+    }
+
+    if (work->deadline_us) {
+      deadline = ThreadPool::now() + (uint64_t)work->deadline_us * 1000;
+    }
+
+    queued(work);
+
+    // SWISS_PRIO_* and TASK_PRIO_* share values
+    threads_.addWork(&dispatch, data, 1, work->priority, deadline);
+  }
+
+  /*
+   * queues connections accepted together as one task. the batch runs
+   * at the most urgent priority and earliest deadline of its members.
+   */
+  void handleBatch(std::vector<swiss_work_st *> &works)
+  {
+    batch_st *batch;
+    uint32_t priority = SWISS_PRIO_LOW;
+    uint64_t deadline = 0;
+    uint64_t now;
+
+    if (works.size() == 1) {
+      handleRequest(works[0]);
+      works.clear();
+      return;
+    }
+
+    now = ThreadPool::now();
+
+    for (unsigned int i = 0; i < works.size(); ++i) {
+      swiss_work_st *work = works[i];
+
+      if (classify_fp_) {
+	classify_fp_(work);
+      }
+
+      if (work->priority < priority) {
+	priority = work->priority;
+      }
+
+      if ((work->deadline_us) && 
+	  ((!deadline) || (now + (uint64_t)work->deadline_us * 1000 < deadline))) {
+	deadline = now + (uint64_t)work->deadline_us * 1000;
+      }
+
+      queued(work);
+    }
+
+    batch = new batch_st;
+    batch->server = this;
+    batch->works.swap(works);
+
+    threads_.addWork(&dispatchBatch, batch, 1, priority, deadline);
+  }
+
+  void queued(swiss_work_st *work)
+  {
+    request_ctx_st *ctx = (request_ctx_st *)work->core;
+
+    SWISS_TRACE2(enqueue, work->fd, work->priority);
+    if (ctx->timing) {
+      ctx->timing->queued = ThreadPool::now();
+    }
+  }
+
+  static void started(request_ctx_st *ctx)
+  {
+    SWISS_TRACE1(dequeue, ctx->fd);
+    if (ctx->timing) {
+      ctx->timing->started = ThreadPool::now();
+    }
+  }
+
+  static void finished(request_ctx_st *ctx)
+  {
+    if (ctx->timing) {
+      ctx->timing->finished = ThreadPool::now();
+    }
+  }
+
+  static void dispatch(void *data)
+  {
+    swiss_work_st *work = (swiss_work_st *)data;
+    request_ctx_st *ctx = (request_ctx_st *)work->core;
+    Arena *arena = Arena::local();
+
+    work->arena = arena->get();
+    started(ctx);
+
+    // the module owns work from here on and may free it
+    SWISS_TRACE2(module_entry, ctx->fd, ntohs(ctx->server->server_addr_.sin_port));
+    ctx->server->work_fp_(work);
+    SWISS_TRACE1(module_exit, ctx->fd);
+
+    finished(ctx);
+    arena->reset();
+    ctx->server->finish(ctx);
+  }
+
+  static void dispatchBatch(void *data)
+  {
+    batch_st *batch = (batch_st *)data;
+    std::vector<request_ctx_st *> ctxs(batch->works.size());
+    Arena *arena = Arena::local();
+
+    // the whole batch shares the thread's arena
+    for (unsigned int i = 0; i < batch->works.size(); ++i) {
+      ctxs[i] = (request_ctx_st *)batch->works[i]->core;
+      batch->works[i]->arena = arena->get();
+      started(ctxs[i]);
+    }
+
+    SWISS_TRACE2(batch_entry, ctxs.size(), ntohs(batch->server->server_addr_.sin_port));
+    batch->server->batch_fp_(&batch->works[0], batch->works.size());
+    SWISS_TRACE1(batch_exit, ctxs.size());
+
+    arena->reset();
+
+    for (unsigned int i = 0; i < ctxs.size(); ++i) {
+      finished(ctxs[i]);
+      batch->server->finish(ctxs[i]);
+    }
+    delete batch;
+  }
+
+  void finish(request_ctx_st *ctx)
+  {
+    if (capture_) {
+      capture_->closed(ctx->fd, ctx->conn);
+    }
+    if (ctx->timing) {
+      timing_->closed(ctx->timing);
+    }
+    RateLimiter::release(ctx->slot);
+    delete ctx;
+  }
+
+  // acceptor thread only
+  bool admit(const int fd, const struct sockaddr_in &addr, limit_slot_st **slot)
+  {
+    *slot = NULL;
+
+    if ((!limiter_) || (limiter_->admit(addr, ThreadPool::now(), slot) == LIMIT_ADMIT)) {
+      return (true);
+    }
+
+    if (config_.stats) {
+      __sync_fetch_and_add(&config_.stats->rejected, 1);
+    }
+
+    if ((config_.tarpit_ms) && (tarpit_.size() < TARPIT_MAX)) {
+      tarpit_.push_back(std::make_pair(ThreadPool::now() + (uint64_t)config_.tarpit_ms * 1000000, fd));
+    } else {
+      reset(fd);
+    }
+
+    return (false);
+  }
+
+  // acceptor thread only
+  void sweepTarpit()
+  {
+    uint64_t now = ThreadPool::now();
+
+    while ((!tarpit_.empty()) && (tarpit_.front().first <= now)) {
+      reset(tarpit_.front().second);
+      tarpit_.pop_front();
+    }
   }
 
-  static void mainThread(void *server)
+  /*
+   * best effort, each of these may be refused by the kernel or need
+   * privileges. accepted connections inherit NODELAY and BUSY_POLL.
+   */
+  void tuneListener()
   {
-    int listen_fd;
+    int one = 1;
+    int busy_poll = BUSY_POLL_US;
+    int defer = DEFER_ACCEPT_S;
+    int fastopen = FASTOPEN_Q_SIZE;
+
+    setsockopt(listen_fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(listen_fd_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    setsockopt(listen_fd_, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+    setsockopt(listen_fd_, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+  }
+
+  // close without a FIN/TIME_WAIT exchange
+  static void reset(const int fd)
+  {
+    struct linger lg = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+  }
+
+  static void mainThread(void *opaque)
+  {
+    SwissServer *server = (SwissServer *)opaque;
+    struct sockaddr_in addr;
+    limit_slot_st *slot;
+    socklen_t len;
     int conn_fd;
-    struct sockaddr_in addr = ((SwissServer *)server)->server_addr_;
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    assert(listen_fd);
-    
-    assert(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) >= 0);
-    
-    assert(listen(listen_fd, LISTEN_Q_SIZE) >= 0);
-    while (((SwissServer *)server)->run_) {
-      swiss_work_st *work_data = new swiss_work_st;
-      socklen_t len;
-      do {
-	len = sizeof(work_data->addr);
-	if ((conn_fd = accept(listen_fd, (struct sockaddr *) &(work_data->addr), &len)) < 0) {
-	  if ((errno != EPROTO) && (errno != ECONNABORTED)) {
-	    assert(false);
-	  }
+    int cpu;
+    bool spin = server->config_.low_latency;
+    bool nonblock = (spin) || (server->batch_fp_);
+    std::vector<swiss_work_st *> batch;
+
+    // with several processes on the port, prefer the one whose acceptor
+    // runs where the connection's packets are handled
+    if ((spin) && (server->config_.reuse_port) && ((cpu = sched_getcpu()) >= 0)) {
+      setsockopt(server->listen_fd_, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+
+    while (server->run_) {
+      swiss_work_st *work_data;
+      request_ctx_st *ctx;
+
+      if (!server->tarpit_.empty()) {
+	server->sweepTarpit();
+      }
+
+      // don't sit in accept while held connections are due for release
+      if ((!spin) && (batch.empty()) && ((nonblock) || (!server->tarpit_.empty()))) {
+	struct pollfd pfd = { server->listen_fd_, POLLIN, 0 };
+
+	if (poll(&pfd, 1, server->tarpit_.empty() ? -1 : TARPIT_SWEEP_MS) <= 0) {
+	  continue;
+	}
+      }
+
+      /*
+       * connections stay blocking even when the listener isn't, the
+       * module interface is blocking I/O on work->fd
+       */
+      len = sizeof(addr);
+      conn_fd = accept4(server->listen_fd_, (struct sockaddr *) &addr, &len, SOCK_CLOEXEC);
+
+      if (conn_fd < 0) {
+	if ((errno != EPROTO) && (errno != ECONNABORTED) && (errno != EINTR) && 
+	    (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+	  assert(false);
 	}
-      } while (errno == EPROTO || errno == ECONNABORTED);
+	// the backlog is drained, hand over what it held
+	if (!batch.empty()) {
+	  server->handleBatch(batch);
+	} else if (spin) {
+	  ThreadPool::relax();
+	}
+	continue;
+      }
       
+      SWISS_TRACE2(accept, conn_fd, ntohs(server->server_addr_.sin_port));
+
+      if (server->config_.stats) {
+	__sync_fetch_and_add(&server->config_.stats->accepted, 1);
+      }
+
+      if (!server->admit(conn_fd, addr, &slot)) {
+	continue;
+      }
+
+      ctx = new request_ctx_st;
+      ctx->server = server;
+      ctx->slot = slot;
+      ctx->fd = conn_fd;
+      ctx->timing = NULL;
+      ctx->conn = 0;
+
+      if (server->capture_) {
+	ctx->conn = server->capture_->opened(conn_fd);
+      }
+      if (server->timing_) {
+	ctx->timing = server->timing_->opened(conn_fd, ThreadPool::now());
+      }
+
+      work_data = new swiss_work_st;
       work_data->fd = conn_fd;
-      ((SwissServer *)server)->handleRequest((void *)work_data);
+      work_data->addr = addr;
+      work_data->priority = SWISS_PRIO_NORMAL;
+      work_data->deadline_us = 0;
+      work_data->core = ctx;
+      work_data->arena = NULL;
+
+      if (!server->batch_fp_) {
+	server->handleRequest((void *)work_data);
+      } else {
+	batch.push_back(work_data);
+	if (batch.size() >= BATCH_MAX) {
+	  server->handleBatch(batch);
+	}
+      }
     }
   }
 
   ThreadPool threads_;
+  server_config_st config_;
+  RateLimiter *limiter_;
+  Capture *capture_;
+  Timing *timing_;
+  swiss_core_ops_st *ops_;
+  void (*ops_init_)(const swiss_core_ops_st *ops);
+  std::deque<std::pair<uint64_t, int> > tarpit_;
   struct sockaddr_in server_addr_;
+  int listen_fd_;
   void (*work_fp_)(void *opaque);
+  void (*classify_fp_)(swiss_work_st *work);
+  void (*batch_fp_)(swiss_work_st **works, size_t count);
   bool run_;
 };
 
@@ -51,82 +51,349 @@
 #include <vector>
 #include <queue>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <stdint.h>
 
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
 #include <pthread.h>
 
+// stack each worker touches before the pool reports started
+#define PREFAULT_STACK_SIZE (64 * 1024)
+// times a waiting lane may be passed over before it is served anyway
+#define STARVATION_LIMIT 32
+// elastic pools add a thread each time work has waited this long with no thread free
+#define GROW_DELAY_NS   (2ULL * 1000000ULL)
+// threads above the minimum exit after idling this long
+#define RETIRE_IDLE_NS  (5ULL * 1000000000ULL)
+
+
+enum {
+  TASK_PRIO_HIGH = 0,
+  TASK_PRIO_NORMAL,
+  TASK_PRIO_LOW
+};
+
 
 typedef struct task_st {
   void     (*fp)(void *);
   void      *opaque;
   uint32_t   run_count;
+  uint32_t   priority;
+  uint64_t   deadline;   // CLOCK_MONOTONIC ns, 0 if none
+  uint64_t   enqueued;
 
-  task_st() : fp(NULL), opaque(NULL), run_count(1) {}
+  task_st() : fp(NULL), opaque(NULL), run_count(1), priority(TASK_PRIO_NORMAL), deadline(0), 
+	      enqueued(0) {}
   
   task_st(const task_st &s) {
     fp = s.fp;
     opaque = s.opaque;
     run_count = s.run_count;
+    priority = s.priority;
+    deadline = s.deadline;
+    enqueued = s.enqueued;
   }
 
 } task_st;
 
+/*
+ * Scaling counters. Several pools may share one set (the per process
+ * stats in prefork mode), so they are only ever updated atomically.
+ */
+typedef struct pool_metrics_st {
+  volatile uint32_t threads;
+  volatile uint32_t idle;
+  volatile uint64_t grown;
+  volatile uint64_t retired;
+  volatile uint64_t queue_delay_ns;  // smoothed time from enqueue to start
+} pool_metrics_st;
+
+class ThreadPool;
+
+/*
+ * Tasks submitted as a group are queued on the group itself. The pool
+ * queue only carries a ticket per task, so a thread waiting on the group
+ * can run the group's tasks directly instead of blocking.
+ */
+typedef struct task_group_st {
+  ThreadPool            *pool;
+  std::queue<task_st *>  tasks;
+  uint32_t               outstanding;
+  uint32_t               refs;
+  pthread_cond_t         done;
+} task_group_st;
+
 class ThreadPool {
 
 public:
-  ThreadPool(const uint32_t num_threads) : thread_list_(num_threads), stop_(true) {}
+  ThreadPool(const uint32_t num_threads) : thread_list_(num_threads)
+  {
+    init();
+  }
+
+  ThreadPool() : thread_list_(num_cores())
+  {
+    init();
+  }
+
+  ThreadPool(const ThreadPool &p) : thread_list_(p.thread_list_.size())
+  {
+    init();
+    max_threads_ = p.max_threads_;
+    spin_ = p.spin_;
+    cpus_ = p.cpus_;
+    if (p.metrics_ != &p.own_metrics_) {
+      metrics_ = p.metrics_;
+    }
+  }
+
+  /*
+   * lets the pool grow up to max threads while queued work is waiting
+   * and shrink back to its initial size once threads go idle. call
+   * before start.
+   */
+  void setElastic(const uint32_t max)
+  {
+    max_threads_ = (max > thread_list_.size()) ? max : thread_list_.size();
+  }
+
+  /*
+   * workers spin on the queue instead of sleeping on a condition
+   * variable, each pinned to one of cpus in turn. trades whole cores
+   * for wakeup latency; call before start.
+   */
+  void setSpin(const std::vector<int> &cpus)
+  {
+    spin_ = true;
+    cpus_ = cpus;
+  }
+
+  bool spinning() const
+  {
+    return (spin_);
+  }
 
-  ThreadPool() : thread_list_(num_cores()), stop_(true) {}
+  // report scaling to a shared set of counters instead of our own
+  void setMetrics(pool_metrics_st *metrics)
+  {
+    metrics_ = metrics ? metrics : &own_metrics_;
+  }
+
+  const pool_metrics_st &metrics() const
+  {
+    return (*metrics_);
+  }
 
   ~ThreadPool()
   {
     stop();
-    while (task_list_.size()) {
-      delete task_list_.front();
-      task_list_.pop();
+
+    pthread_mutex_lock(&lock_);
+    while (task_count_) {
+      task_st *task = popTask();
+
+      // a ticket that never ran still holds a reference on its group
+      if (task->fp == &groupEntry) {
+	releaseGroup(static_cast<task_group_st *>(task->opaque));
+      }
+      delete task;
     }
+    pthread_mutex_unlock(&lock_);
   }
 
   void addWork(const task_st *work) 
   {
-    addWork(work->fp, work->opaque, work->run_count);    
+    addWork(work->fp, work->opaque, work->run_count, work->priority, work->deadline);
   }
     
-  void addWork(void (*fp)(void *), void *opaque, uint32_t run_count = 1)
+  /*
+   * high priority work always runs first, then work with a deadline in
+   * earliest deadline order, then normal and low priority work FIFO
+   */
+  void addWork(void (*fp)(void *), void *opaque, uint32_t run_count = 1, 
+	       uint32_t priority = TASK_PRIO_NORMAL, uint64_t deadline = 0)
   {
     task_st *new_work = new task_st();
     new_work->fp = fp;
     new_work->opaque = opaque;
     new_work->run_count = run_count;
+    new_work->priority = priority;
+    new_work->deadline = deadline;
 
     if (stop_) {
-      task_list_.push(new_work);
+      pushTask(new_work);
     } else {
       pthread_mutex_lock(&lock_);
-      task_list_.push(new_work);
-      pthread_cond_broadcast(&mon_);
+      pushTask(new_work);
+      if (!spin_) {
+	pthread_cond_broadcast(&mon_);
+      }
       pthread_mutex_unlock(&lock_);
     }
   }
+
+  static inline void relax()
+  {
+    asm volatile ("pause" ::: "memory");
+  }
+
+  // parses a cpu list as found in sysfs, i.e. "0-3,8-11"
+  static void parseCpuList(const char *list, std::vector<int> &cpus)
+  {
+    char buffer[4096];
+
+    strncpy(buffer, list, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    for (char *save, *tok = strtok_r(buffer, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)) {
+      int first;
+      int last;
+
+      if (sscanf(tok, "%d-%d", &first, &last) != 2) {
+	last = first = atoi(tok);
+      }
+      for (int cpu = first; cpu <= last; ++cpu) {
+	cpus.push_back(cpu);
+      }
+    }
+  }
+
+  static uint64_t now()
+  {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+  }
+  
+  task_group_st *createGroup()
+  {
+    task_group_st *group = new task_group_st;
+
+    group->pool = this;
+    group->outstanding = 0;
+    group->refs = 1;
+    assert(pthread_cond_init(&group->done, NULL) == 0);
+
+    return (group);
+  }
+
+  void addGroupWork(task_group_st *group, void (*fp)(void *), void **opaques, const size_t count)
+  {
+    pthread_mutex_lock(&lock_);
+    for (size_t i = 0; i < count; ++i) {
+      task_st *task = new task_st();
+      task_st *ticket = new task_st();
+
+      task->fp = fp;
+      task->opaque = opaques[i];
+      group->tasks.push(task);
+
+      ticket->fp = &groupEntry;
+      ticket->opaque = group;
+      pushTask(ticket);
+    }
+    group->outstanding += count;
+    group->refs += count;
+    pthread_cond_broadcast(&mon_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // runs the group's queued tasks on the calling thread until all are done
+  void waitGroup(task_group_st *group)
+  {
+    pthread_mutex_lock(&lock_);
+    while (group->outstanding) {
+      if (!group->tasks.empty()) {
+	runGroupTask(group);
+      } else {
+	pthread_cond_wait(&group->done, &lock_);
+      }
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void destroyGroup(task_group_st *group)
+  {
+    waitGroup(group);
+
+    pthread_mutex_lock(&lock_);
+    releaseGroup(group);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  uint32_t size() const
+  {
+    return (thread_list_.size());
+  }
+
+  static void *opsGroupCreate(void *pool)
+  {
+    return (static_cast<ThreadPool *>(pool)->createGroup());
+  }
+
+  static void opsGroupRun(void *group, void (*fp)(void *), void **opaques, const size_t count)
+  {
+    static_cast<task_group_st *>(group)->pool->addGroupWork(static_cast<task_group_st *>(group), 
+							     fp, opaques, count);
+  }
+
+  static void opsGroupWait(void *group)
+  {
+    static_cast<task_group_st *>(group)->pool->waitGroup(static_cast<task_group_st *>(group));
+  }
+
+  static void opsGroupDestroy(void *group)
+  {
+    static_cast<task_group_st *>(group)->pool->destroyGroup(static_cast<task_group_st *>(group));
+  }
   
   void stop()
   {
     pthread_mutex_lock(&lock_);
     stop_ = true;
+    if (max_threads_) {
+      pthread_cond_signal(&grow_mon_);
+    }
     pthread_mutex_unlock(&lock_);
+
+    // the grower sleeps on lock_ and grow_mon_, it has to be gone before they are
+    if (growing_) {
+      pthread_join(grower_, NULL);
+      growing_ = false;
+    }
   }
   
+  /*
+   * returns once every worker is running with its stack faulted in, so
+   * the first tasks don't pay for thread startup
+   */
   void start() 
   { 
     stop_ = false;
-    assert(pthread_mutex_init(&lock_, NULL) == 0);
-    assert(pthread_cond_init(&mon_, NULL) == 0);
+    ready_ = 0;
+    threads_ = thread_list_.size();
+
+    __sync_fetch_and_add(&metrics_->threads, threads_);
 
     for (uint32_t i = 0; i < thread_list_.size(); ++i) {
       assert(pthread_create(&thread_list_[i], NULL, threadEntry, this) == 0);
     } 
+
+    if (max_threads_) {
+      assert(pthread_create(&grower_, NULL, growEntry, this) == 0);
+      growing_ = true;
+    }
     
+    pthread_mutex_lock(&lock_);
+    while (ready_ < thread_list_.size()) {
+      pthread_cond_wait(&ready_mon_, &lock_);
+    }
+    pthread_mutex_unlock(&lock_);
   }
   
   
@@ -134,26 +401,292 @@ private:
   
   static void *threadEntry(void *opaque)
   {
-    static_cast<ThreadPool *>(opaque)->doWork();
+    ThreadPool *pool = static_cast<ThreadPool *>(opaque);
+
+    // elastic threads may exit at any time and are never joined
+    if (pool->max_threads_) {
+      pthread_detach(pthread_self());
+    }
+
+    if (!pool->cpus_.empty()) {
+      cpu_set_t set;
+      uint32_t n = __sync_fetch_and_add(&pinCursor(), 1);
+
+      CPU_ZERO(&set);
+      CPU_SET(pool->cpus_[n % pool->cpus_.size()], &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    prefault();
+
+    pthread_mutex_lock(&pool->lock_);
+    ++pool->ready_;
+    pthread_cond_signal(&pool->ready_mon_);
+    pthread_mutex_unlock(&pool->lock_);
+
+    pool->doWork();
+    return (NULL);
+  }
+
+  // shared by every pool, so spinning modules spread over the list instead of piling onto its head
+  static uint32_t &pinCursor()
+  {
+    static uint32_t cursor = 0;
+
+    return (cursor);
+  }
+
+  enum {
+    LANE_HIGH = 0,
+    LANE_DEADLINE,
+    LANE_NORMAL,
+    LANE_LOW,
+    LANE_COUNT
+  };
+
+  struct deadline_later {
+    bool operator()(const task_st *a, const task_st *b) const
+    {
+      return (a->deadline > b->deadline);
+    }
+  };
+
+  bool laneEmpty(const int lane) const
+  {
+    if (lane == LANE_DEADLINE) {
+      return (deadline_lane_.empty());
+    }
+    return (lanes_[lane].empty());
+  }
+
+  // lock_ is held, or the pool is not started
+  void pushTask(task_st *task)
+  {
+    if (task->priority == TASK_PRIO_HIGH) {
+      lanes_[LANE_HIGH].push(task);
+    } else if (task->deadline) {
+      deadline_lane_.push(task);
+    } else if (task->priority == TASK_PRIO_LOW) {
+      lanes_[LANE_LOW].push(task);
+    } else {
+      lanes_[LANE_NORMAL].push(task);
+    }
+    task->enqueued = now();
+    ++task_count_;
+
+    // every thread is busy, start the clock on growing the pool
+    if ((max_threads_) && (!stop_) && (!idle_) && (!stalled_since_)) {
+      stalled_since_ = task->enqueued;
+      pthread_cond_signal(&grow_mon_);
+    }
+  }
+
+  /*
+   * lock_ is held and task_count_ is non-zero. lanes are strictly
+   * ordered, except a lane that has waited through STARVATION_LIMIT
+   * picks from the lanes above it is served next.
+   */
+  task_st *popTask()
+  {
+    task_st *task;
+    int lane = -1;
+
+    for (int l = LANE_HIGH + 1; l < LANE_COUNT; ++l) {
+      if ((!laneEmpty(l)) && (skipped_[l] >= STARVATION_LIMIT)) {
+	lane = l;
+	break;
+      }
+    }
+
+    if (lane < 0) {
+      for (lane = LANE_HIGH; laneEmpty(lane); ++lane) {
+	;
+      }
+    }
+
+    for (int l = lane + 1; l < LANE_COUNT; ++l) {
+      if (!laneEmpty(l)) {
+	++skipped_[l];
+      }
+    }
+    skipped_[lane] = 0;
+
+    if (lane == LANE_DEADLINE) {
+      task = deadline_lane_.top();
+      deadline_lane_.pop();
+    } else {
+      task = lanes_[lane].front();
+      lanes_[lane].pop();
+    }
+    --task_count_;
+
+    return (task);
+  }
+
+  // the lock and condition variables exist from here on, so stop() is safe before start()
+  void init()
+  {
+    pthread_condattr_t attr;
+
+    assert(pthread_mutex_init(&lock_, NULL) == 0);
+    assert(pthread_condattr_init(&attr) == 0);
+    assert(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0);
+    assert(pthread_cond_init(&mon_, &attr) == 0);
+    assert(pthread_cond_init(&ready_mon_, NULL) == 0);
+    assert(pthread_cond_init(&grow_mon_, &attr) == 0);
+    pthread_condattr_destroy(&attr);
+
+    memset(skipped_, 0, sizeof(skipped_));
+    memset(&own_metrics_, 0, sizeof(own_metrics_));
+    metrics_ = &own_metrics_;
+    task_count_ = 0;
+    max_threads_ = 0;
+    spin_ = false;
+    threads_ = 0;
+    idle_ = 0;
+    stalled_since_ = 0;
+    ready_ = 0;
+    growing_ = false;
+    stop_ = true;
+  }
+
+  /*
+   * elastic pools only. sleeps until work has sat in the queue for
+   * GROW_DELAY_NS without a thread going idle, then adds a thread and
+   * starts the clock again. workers blocked in module I/O can't notice
+   * the backlog themselves, hence a thread of its own.
+   */
+  static void *growEntry(void *opaque)
+  {
+    ThreadPool *pool = static_cast<ThreadPool *>(opaque);
+    struct timespec ts;
+    pthread_t thread;
+    uint64_t now;
+    uint64_t deadline;
+
+    pthread_mutex_lock(&pool->lock_);
+    while (!pool->stop_) {
+      if ((!pool->stalled_since_) || (pool->threads_ >= pool->max_threads_)) {
+	pthread_cond_wait(&pool->grow_mon_, &pool->lock_);
+	continue;
+      }
+
+      now = ThreadPool::now();
+      deadline = pool->stalled_since_ + GROW_DELAY_NS;
+
+      if (now < deadline) {
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	pthread_cond_timedwait(&pool->grow_mon_, &pool->lock_, &ts);
+	continue;
+      }
+
+      if (pthread_create(&thread, NULL, threadEntry, pool) == 0) {
+	++pool->threads_;
+	__sync_fetch_and_add(&pool->metrics_->threads, 1);
+	__sync_fetch_and_add(&pool->metrics_->grown, 1);
+      }
+      pool->stalled_since_ = now;
+    }
+    pthread_mutex_unlock(&pool->lock_);
+
     return (NULL);
   }
+
+  // lock_ is held on entry and on return, but not while the task runs
+  void runGroupTask(task_group_st *group)
+  {
+    task_st *task = group->tasks.front();
+
+    group->tasks.pop();
+    pthread_mutex_unlock(&lock_);
+
+    task->fp(task->opaque);
+    delete task;
+
+    pthread_mutex_lock(&lock_);
+    if (--group->outstanding == 0) {
+      pthread_cond_broadcast(&group->done);
+    }
+  }
+
+  // lock_ is held. tasks are only left over if the pool went away first
+  void releaseGroup(task_group_st *group)
+  {
+    if (--group->refs == 0) {
+      while (!group->tasks.empty()) {
+	delete group->tasks.front();
+	group->tasks.pop();
+      }
+      pthread_cond_destroy(&group->done);
+      delete group;
+    }
+  }
+
+  // a ticket may find its task already taken by a waiting thread
+  static void groupEntry(void *opaque)
+  {
+    task_group_st *group = static_cast<task_group_st *>(opaque);
+    ThreadPool *pool = group->pool;
+
+    pthread_mutex_lock(&pool->lock_);
+    if (!group->tasks.empty()) {
+      pool->runGroupTask(group);
+    }
+    pool->releaseGroup(group);
+    pthread_mutex_unlock(&pool->lock_);
+  }
+
+  static void prefault()
+  {
+    uint8_t stack[PREFAULT_STACK_SIZE];
+
+    memset(stack, 0, sizeof(stack));
+    asm volatile ("" : : "r" (stack) : "memory");
+  }
   
   void doWork() 
   {
     task_st *work = NULL;
 
     while (true) {
+      uint64_t delay;
+
       pthread_mutex_lock(&lock_);
-      while (task_list_.empty()) {
+      while (!task_count_) {
+	int rc;
+
 	if (stop_) {
+	  --threads_;
+	  __sync_fetch_and_sub(&metrics_->threads, 1);
 	  pthread_mutex_unlock(&lock_);
 	  pthread_exit(NULL);
 	} 
-        pthread_cond_wait(&mon_, &lock_); 
+
+	++idle_;
+	stalled_since_ = 0;
+	__sync_fetch_and_add(&metrics_->idle, 1);
+	rc = waitForWork();
+	__sync_fetch_and_sub(&metrics_->idle, 1);
+	--idle_;
+
+	if ((rc == ETIMEDOUT) && (!task_count_) && (threads_ > thread_list_.size())) {
+	  --threads_;
+	  __sync_fetch_and_sub(&metrics_->threads, 1);
+	  __sync_fetch_and_add(&metrics_->retired, 1);
+	  pthread_mutex_unlock(&lock_);
+	  pthread_exit(NULL);
+	}
       }
       
-      work = task_list_.front();
-      task_list_.pop();
+      work = popTask();
+
+      if (!task_count_) {
+	stalled_since_ = 0;
+      }
+
+      delay = now() - work->enqueued;
+      smoothDelay(delay);
 
       pthread_mutex_unlock(&lock_);
       
@@ -172,6 +705,47 @@ private:
     }
   }
   
+  // other pools may share metrics_, so the average is folded in with a CAS
+  void smoothDelay(const uint64_t delay)
+  {
+    uint64_t seen = metrics_->queue_delay_ns;
+
+    while (true) {
+      uint64_t prev = __sync_val_compare_and_swap(&metrics_->queue_delay_ns, seen, 
+						  (seen * 7 + delay) / 8);
+      if (prev == seen) {
+	break;
+      }
+      seen = prev;
+    }
+  }
+
+  // lock_ is held, elastic pools wake up now and then to retire
+  int waitForWork()
+  {
+    struct timespec ts;
+    uint64_t deadline;
+
+    if (spin_) {
+      pthread_mutex_unlock(&lock_);
+      while ((!*(volatile uint32_t *)&task_count_) && (!*(volatile bool *)&stop_)) {
+	relax();
+      }
+      pthread_mutex_lock(&lock_);
+      return (0);
+    }
+
+    if (!max_threads_) {
+      return (pthread_cond_wait(&mon_, &lock_));
+    }
+
+    deadline = now() + RETIRE_IDLE_NS;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+
+    return (pthread_cond_timedwait(&mon_, &lock_, &ts));
+  }
+  
   inline void cpuid(uint32_t &eax, uint32_t &ebx, uint32_t &ecx, uint32_t &edx) const
   {
     asm ( "cpuid;"
@@ -215,9 +789,25 @@ private:
 
 
   std::vector<pthread_t> thread_list_;
-  std::queue<task_st *> task_list_;
+  std::queue<task_st *> lanes_[LANE_COUNT];
+  std::priority_queue<task_st *, std::vector<task_st *>, deadline_later> deadline_lane_;
+  uint32_t skipped_[LANE_COUNT];
+  uint32_t task_count_;
+  uint32_t max_threads_;
+  bool spin_;
+  std::vector<int> cpus_;
+  uint32_t threads_;
+  uint32_t idle_;
+  uint64_t stalled_since_;
+  pool_metrics_st own_metrics_;
+  pool_metrics_st *metrics_;
   pthread_mutex_t lock_;
   pthread_cond_t mon_;
+  pthread_cond_t ready_mon_;
+  pthread_cond_t grow_mon_;
+  pthread_t grower_;
+  bool growing_;
+  uint32_t ready_;
   bool stop_;
 
 };
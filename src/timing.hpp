@@ -0,0 +1,257 @@
+/*
+ * timing.hpp
+ *
+ *
+ * Swiss Request Timing
+ *
+ *
+ * Copyright (C) 2012-2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#ifndef __TIMING__
+#define __TIMING__
+
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+#include "include/module.h"
+
+// highest fd a connection can be timed under
+#define TIMING_MAX_FD 65536
+// finished samples kept per server, a power of 2
+#define TIMING_RING 4096
+
+
+/*
+ * Samples one connection in every N and records where its time went:
+ * accept to queue, waiting in the pool queue, reading, writing and the
+ * rest of the module's work. The record lives with the connection and
+ * is found by fd from the module library's I/O wrappers, like capture.
+ * The acceptor sets the fd's slot for every connection it takes,
+ * sampled or not, so a record is never found under an fd that has
+ * since gone to another connection.
+ * Finished records go into a ring that overwrites the oldest; dump()
+ * summarizes it on demand. Slots carry a sequence number so a dump
+ * skips one that is being rewritten under it.
+ */
+class Timing {
+
+public:
+  Timing(const uint16_t port, const uint32_t sample) : port_(port), sample_(sample), count_(0), 
+						       head_(0)
+  {
+    conns_ = new swiss_timing_st *[TIMING_MAX_FD];
+    memset(conns_, 0, sizeof(swiss_timing_st *) * TIMING_MAX_FD);
+    ring_ = new slot_st[TIMING_RING];
+    memset(ring_, 0, sizeof(slot_st) * TIMING_RING);
+  }
+
+  ~Timing()
+  {
+    delete [] conns_;
+    delete [] ring_;
+  }
+
+  // acceptor thread only, a new record for a connection that is sampled
+  swiss_timing_st *opened(const int fd, const uint64_t now)
+  {
+    swiss_timing_st *timing = NULL;
+
+    if ((fd < 0) || (fd >= TIMING_MAX_FD)) {
+      return (NULL);
+    }
+
+    if ((++count_ % sample_) == 0) {
+      timing = new swiss_timing_st;
+      memset(timing, 0, sizeof(swiss_timing_st));
+      timing->fd = fd;
+      timing->accepted = now;
+    }
+
+    // anything still here belongs to a connection that has closed the fd
+    conns_[fd] = timing;
+
+    return (timing);
+  }
+
+  // stores the finished record and frees it
+  void closed(swiss_timing_st *timing)
+  {
+    slot_st *slot;
+    uint64_t seq;
+
+    // the fd may already belong to a newer connection
+    __sync_bool_compare_and_swap(&conns_[timing->fd], timing, NULL);
+
+    seq = __sync_add_and_fetch(&head_, 1);
+    slot = &ring_[seq & (TIMING_RING - 1)];
+    slot->seq = 0;
+    __sync_synchronize();
+    slot->timing = *timing;
+    __sync_synchronize();
+    slot->seq = seq;
+
+    delete timing;
+  }
+
+  swiss_timing_st *find(const int fd)
+  {
+    if ((fd < 0) || (fd >= TIMING_MAX_FD)) {
+      return (NULL);
+    }
+
+    return (conns_[fd]);
+  }
+
+  static swiss_timing_st *opsFind(void *timing, const int fd)
+  {
+    return (static_cast<Timing *>(timing)->find(fd));
+  }
+
+  /*
+   * percentiles of each phase in microseconds over what the ring holds,
+   * then the breakdown of the slowest request
+   */
+  void dump(std::ostream &out)
+  {
+    std::vector<uint64_t> phases[PHASE_COUNT];
+    uint64_t slowest[PHASE_COUNT];
+    uint64_t phase[PHASE_COUNT];
+    swiss_timing_st timing;
+    uint64_t seq;
+
+    memset(slowest, 0, sizeof(slowest));
+
+    for (unsigned int i = 0; i < TIMING_RING; ++i) {
+      if ((seq = ring_[i].seq) == 0) {
+	continue;
+      }
+      __sync_synchronize();
+      timing = ring_[i].timing;
+      __sync_synchronize();
+      if (ring_[i].seq != seq) {
+	continue;
+      }
+
+      split(timing, phase);
+      for (unsigned int p = 0; p < PHASE_COUNT; ++p) {
+	phases[p].push_back(phase[p]);
+      }
+      if (phase[PHASE_TOTAL] > slowest[PHASE_TOTAL]) {
+	memcpy(slowest, phase, sizeof(slowest));
+      }
+    }
+
+    if (phases[0].empty()) {
+      out << "Timing port " << port_ << ": no samples" << std::endl;
+      return;
+    }
+
+    out << "Timing port " << port_ << ": " << phases[0].size() << " samples, 1 in " << sample_ 
+	<< ", us p50/p99/max";
+    for (unsigned int p = 0; p < PHASE_COUNT; ++p) {
+      std::sort(phases[p].begin(), phases[p].end());
+      out << " " << phaseName(p) << " " << percentile(phases[p], 50) << "/" 
+	  << percentile(phases[p], 99) << "/" << phases[p].back() / 1000;
+    }
+    out << std::endl;
+
+    out << "Timing port " << port_ << ": slowest";
+    for (unsigned int p = 0; p < PHASE_COUNT; ++p) {
+      out << " " << phaseName(p) << " " << slowest[p] / 1000;
+    }
+    out << std::endl;
+  }
+
+private:
+  enum {
+    PHASE_ACCEPT = 0,
+    PHASE_QUEUE,
+    PHASE_READ,
+    PHASE_WRITE,
+    PHASE_MODULE,   // the module's own work, its I/O taken out
+    PHASE_TOTAL,
+    PHASE_COUNT
+  };
+
+  typedef struct slot_st {
+    volatile uint64_t seq;
+    swiss_timing_st   timing;
+  } slot_st;
+
+  static void split(const swiss_timing_st &timing, uint64_t *phase)
+  {
+    uint64_t module = timing.finished - timing.started;
+    uint64_t io = timing.read_ns + timing.write_ns;
+
+    phase[PHASE_ACCEPT] = timing.queued - timing.accepted;
+    phase[PHASE_QUEUE] = timing.started - timing.queued;
+    phase[PHASE_READ] = timing.read_ns;
+    phase[PHASE_WRITE] = timing.write_ns;
+    phase[PHASE_MODULE] = (module > io) ? module - io : 0;
+    phase[PHASE_TOTAL] = timing.finished - timing.accepted;
+  }
+
+  static const char *phaseName(const unsigned int phase)
+  {
+    static const char *names[PHASE_COUNT] = { "accept", "queue", "read", "write", "module", "total" };
+
+    return (names[phase]);
+  }
+
+  static uint64_t percentile(const std::vector<uint64_t> &sorted, const unsigned int pct)
+  {
+    return (sorted[(sorted.size() - 1) * pct / 100] / 1000);
+  }
+
+  uint16_t port_;
+  uint32_t sample_;
+  uint64_t count_;
+  volatile uint64_t head_;
+  swiss_timing_st **conns_;
+  slot_st *ring_;
+};
+
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * replay.cc
+ *
+ *
+ * Swiss Traffic Replay Tool
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../include/capture.h"
+
+#define EPOLL_EVENTS 256
+#define READ_BUFFER 65536
+// how long to wait for responses once every record has been sent
+#define DRAIN_TIMEOUT_S 10
+
+
+typedef struct event_st {
+  uint64_t ts_ns;
+  uint32_t conn;
+  uint16_t type;
+  const uint8_t *data;
+  uint32_t len;
+} event_st;
+
+typedef struct conn_st {
+  int fd;
+  bool closing;            // capture saw the module finish, half close once sent
+  std::vector<uint8_t> out;
+  size_t sent;
+  uint64_t opened;
+} conn_st;
+
+typedef struct replay_stats_st {
+  uint64_t conns;
+  uint64_t failed;
+  uint64_t bytes_out;
+  uint64_t bytes_in;
+  std::vector<uint64_t> latency;  // open to server close, ns
+
+  replay_stats_st() : conns(0), failed(0), bytes_out(0), bytes_in(0) {}
+} replay_stats_st;
+
+
+static uint64_t now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static bool eventEarlier(const event_st &a, const event_st &b)
+{
+  return (a.ts_ns < b.ts_ns);
+}
+
+static void usage()
+{
+  std::cout << "usage: swiss_replay [-h host] [-p port] [-r rate] capture_file\n"
+	    << "  -h  server to replay against (default 127.0.0.1)\n"
+	    << "  -p  port, defaults to the one the capture was taken on\n"
+	    << "  -r  speed relative to the capture, 2 is twice as fast, 0 as fast as possible\n";
+}
+
+/*
+ * Flattens the capture into events. Records of one connection are
+ * already in order, a stable sort by time keeps them that way.
+ */
+static bool loadCapture(const uint8_t *base, const size_t size, uint32_t *port, 
+			std::vector<event_st> &events)
+{
+  const swiss_capture_hdr_st *hdr = (const swiss_capture_hdr_st *)base;
+  size_t offset = sizeof(swiss_capture_hdr_st);
+
+  if ((size < sizeof(swiss_capture_hdr_st)) || (hdr->magic != SWISS_CAPTURE_MAGIC)) {
+    return (false);
+  }
+
+  *port = hdr->port;
+
+  while (offset + sizeof(swiss_capture_rec_st) <= size) {
+    const swiss_capture_rec_st *rec = (const swiss_capture_rec_st *)(base + offset);
+    event_st event;
+
+    if ((!rec->type) || (offset + sizeof(swiss_capture_rec_st) + rec->len > size)) {
+      break;
+    }
+
+    event.ts_ns = rec->ts_ns;
+    event.conn = rec->conn;
+    event.type = rec->type;
+    event.data = (const uint8_t *)(rec + 1);
+    event.len = rec->len;
+    events.push_back(event);
+
+    offset += (sizeof(swiss_capture_rec_st) + rec->len + SWISS_CAPTURE_ALIGN - 1) & 
+      ~((size_t)SWISS_CAPTURE_ALIGN - 1);
+  }
+
+  std::stable_sort(events.begin(), events.end(), eventEarlier);
+
+  return (true);
+}
+
+
+class Replay {
+
+public:
+  Replay(const struct sockaddr_in &addr) : addr_(addr)
+  {
+    if ((epoll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      throw "epoll_create failed";
+    }
+  }
+
+  ~Replay()
+  {
+    close(epoll_fd_);
+  }
+
+  void run(const std::vector<event_st> &events, const double rate)
+  {
+    uint64_t start = now();
+    uint64_t deadline;
+
+    for (unsigned int i = 0; i < events.size(); ++i) {
+      const event_st &event = events[i];
+
+      if (rate > 0) {
+	uint64_t due = start + (uint64_t)(event.ts_ns / rate);
+	uint64_t t;
+
+	while ((t = now()) < due) {
+	  service((due - t) / 1000000);
+	}
+      } else {
+	service(0);
+      }
+
+      apply(event);
+    }
+
+    deadline = now() + DRAIN_TIMEOUT_S * 1000000000ULL;
+    while ((!conns_.empty()) && (now() < deadline)) {
+      service(100);
+    }
+
+    report(now() - start);
+  }
+
+private:
+  void apply(const event_st &event)
+  {
+    std::map<uint32_t, conn_st>::iterator it = conns_.find(event.conn);
+
+    switch (event.type) {
+    case SWISS_CAPTURE_OPEN:
+      openConn(event.conn);
+      break;
+    case SWISS_CAPTURE_DATA:
+      if (it != conns_.end()) {
+	it->second.out.insert(it->second.out.end(), event.data, event.data + event.len);
+	flush(event.conn, it->second);
+      }
+      break;
+    case SWISS_CAPTURE_CLOSE:
+      if (it != conns_.end()) {
+	it->second.closing = true;
+	flush(event.conn, it->second);
+      }
+      break;
+    }
+  }
+
+  void openConn(const uint32_t id)
+  {
+    struct epoll_event ev;
+    conn_st conn;
+    int one = 1;
+
+    ++stats_.conns;
+
+    if ((conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      ++stats_.failed;
+      return;
+    }
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if ((connect(conn.fd, (struct sockaddr *)&addr_, sizeof(addr_)) < 0) && (errno != EINPROGRESS)) {
+      close(conn.fd);
+      ++stats_.failed;
+      return;
+    }
+
+    conn.closing = false;
+    conn.sent = 0;
+    conn.opened = now();
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u32 = id;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn.fd, &ev);
+
+    conns_[id] = conn;
+  }
+
+  void flush(const uint32_t id, conn_st &conn)
+  {
+    ssize_t sent;
+
+    while (conn.sent < conn.out.size()) {
+      if ((sent = send(conn.fd, &conn.out[conn.sent], conn.out.size() - conn.sent, MSG_NOSIGNAL)) < 0) {
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+	  drop(id, conn);
+	}
+	return;
+      }
+      conn.sent += sent;
+      stats_.bytes_out += sent;
+    }
+
+    conn.out.clear();
+    conn.sent = 0;
+
+    if (conn.closing) {
+      shutdown(conn.fd, SHUT_WR);
+    }
+  }
+
+  // reads responses until the server closes
+  void receive(const uint32_t id, conn_st &conn)
+  {
+    uint8_t buffer[READ_BUFFER];
+    ssize_t len;
+
+    while ((len = recv(conn.fd, buffer, sizeof(buffer), 0)) > 0) {
+      stats_.bytes_in += len;
+    }
+
+    if (len == 0) {
+      stats_.latency.push_back(now() - conn.opened);
+      close(conn.fd);
+      conns_.erase(id);
+    } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      drop(id, conn);
+    }
+  }
+
+  void drop(const uint32_t id, conn_st &conn)
+  {
+    ++stats_.failed;
+    close(conn.fd);
+    conns_.erase(id);
+  }
+
+  void service(const int timeout_ms)
+  {
+    struct epoll_event events[EPOLL_EVENTS];
+    int count = epoll_wait(epoll_fd_, events, EPOLL_EVENTS, timeout_ms);
+
+    for (int i = 0; i < count; ++i) {
+      std::map<uint32_t, conn_st>::iterator it = conns_.find(events[i].data.u32);
+
+      if (it == conns_.end()) {
+	continue;
+      }
+
+      if (events[i].events & EPOLLOUT) {
+	flush(it->first, it->second);
+	if ((it = conns_.find(events[i].data.u32)) == conns_.end()) {
+	  continue;
+	}
+      }
+
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+	receive(it->first, it->second);
+      }
+    }
+  }
+
+  void report(const uint64_t elapsed)
+  {
+    std::vector<uint64_t> &lat = stats_.latency;
+    double secs = elapsed / 1e9;
+
+    std::sort(lat.begin(), lat.end());
+
+    printf("connections %llu failed %llu unfinished %llu in %.3fs (%.0f conn/s)\n",
+	   (unsigned long long)stats_.conns, (unsigned long long)stats_.failed, 
+	   (unsigned long long)conns_.size(), secs, secs > 0 ? stats_.conns / secs : 0.0);
+    printf("sent %llu bytes, received %llu bytes\n", 
+	   (unsigned long long)stats_.bytes_out, (unsigned long long)stats_.bytes_in);
+
+    if (!lat.empty()) {
+      printf("latency us p50 %llu p90 %llu p99 %llu max %llu\n",
+	     (unsigned long long)lat[lat.size() / 2] / 1000, 
+	     (unsigned long long)lat[lat.size() * 9 / 10] / 1000,
+	     (unsigned long long)lat[lat.size() * 99 / 100] / 1000, 
+	     (unsigned long long)lat.back() / 1000);
+    }
+  }
+
+  struct sockaddr_in addr_;
+  int epoll_fd_;
+  std::map<uint32_t, conn_st> conns_;
+  replay_stats_st stats_;
+};
+
+
+int main(int argc, char *argv[])
+{
+  const char *host = "127.0.0.1";
+  uint32_t port = 0;
+  uint32_t capture_port;
+  double rate = 1.0;
+  std::vector<event_st> events;
+  struct sockaddr_in addr;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct stat st;
+  uint8_t *base;
+  int opt;
+  int fd;
+
+  while ((opt = getopt(argc, argv, "h:p:r:")) != -1) {
+    switch (opt) {
+    case 'h':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    default:
+      usage();
+      return (EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+    return (EXIT_FAILURE);
+  }
+
+  if (((fd = open(argv[optind], O_RDONLY)) < 0) || (fstat(fd, &st) < 0) ||
+      ((base = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+    std::cout << "unable to map " << argv[optind] << std::endl;
+    return (EXIT_FAILURE);
+  }
+  close(fd);
+
+  if (!loadCapture(base, st.st_size, &capture_port, events)) {
+    std::cout << argv[optind] << " is not a capture file" << std::endl;
+    return (EXIT_FAILURE);
+  }
+
+  if (!port) {
+    port = capture_port;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    std::cout << "unable to resolve " << host << std::endl;
+    return (EXIT_FAILURE);
+  }
+  addr = *(struct sockaddr_in *)res->ai_addr;
+  addr.sin_port = htons(port);
+  freeaddrinfo(res);
+
+  try {
+    Replay replay(addr);
+    replay.run(events, rate);
+  } catch (const char *msg) {
+    std::cout << "Exception: " << msg << std::endl;
+    return (EXIT_FAILURE);
+  }
+
+  munmap(base, st.st_size);
+
+  return (EXIT_SUCCESS);
+}